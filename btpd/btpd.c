@@ -1,6 +1,7 @@
 #include "btpd.h"
 
 #include <openssl/sha.h>
+#include <sha1.h>
 #include <signal.h>
 
 static uint8_t m_peer_id[20];
@@ -87,6 +88,7 @@ void tr_init(void);
 void ipc_init(void);
 void td_init(void);
 void addrinfo_init(void);
+void dio_init(void);
 
 void
 btpd_init(void)
@@ -121,12 +123,15 @@ btpd_init(void)
 
     srandom(seed);
 
+    sha1_init();
+    btpd_log(BTPD_L_BTPD, "Using the %s SHA-1 code.\n", sha1_backend());
+
     td_init();
     addrinfo_init();
+    dio_init();
     net_init();
     ipc_init();
     ul_init();
-    cm_init();
     tr_init();
     tlib_init();
 
@@ -74,12 +74,14 @@ __attribute__((malloc))
 void *btpd_malloc(size_t size);
 __attribute__((malloc))
 void *btpd_calloc(size_t nmemb, size_t size);
+void *btpd_realloc(void *ptr, size_t size);
 
 void btpd_ev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb,
     void *arg);
 void btpd_ev_del(struct fdev *ev);
 void btpd_ev_enable(struct fdev *ev, uint16_t flags);
 void btpd_ev_disable(struct fdev *ev, uint16_t flags);
+void btpd_ev_again(struct fdev *ev, uint16_t flags);
 void btpd_timer_add(struct timeout *to, struct timespec *ts);
 void btpd_timer_del(struct timeout *to);
 
@@ -101,6 +103,26 @@ void td_post(void (*cb)(void *), void *arg);
 void td_post_end();
 #define td_post_begin td_acquire_lock
 
+struct dio_job {
+    void (*fun)(struct dio_job *);
+    void (*cb)(struct dio_job *);
+    size_t len;
+    int worker;
+    BTPDQ_ENTRY(dio_job) entry;
+};
+
+/*
+ * The disk pool has DIO_NTHREADS workers for reads and writes, and
+ * cm_hash_threads more that only take jobs submitted to DIO_HASH.
+ */
+#define DIO_NTHREADS 4
+#define DIO_HASH (-2)
+
+extern unsigned dio_nthreads;
+
+void dio_submit(struct dio_job *job, int worker);
+int dio_congested(void);
+
 typedef struct ai_ctx * aictx_t;
 aictx_t btpd_addrinfo(const char *node, uint16_t port, struct addrinfo *hints,
     void (*cb)(void *, int, struct addrinfo *), void *arg);
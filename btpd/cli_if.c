@@ -164,6 +164,38 @@ write_ans(struct iobuf *iob, struct tlib *tl, enum ipc_tval val)
         else
             iobuf_print(iob, "i%dei%de", IPC_TYPE_ERR, IPC_EBADTENT);
        return;
+    case IPC_TVAL_REQDEPTH:
+        if (tl->tp == NULL)
+            iobuf_print(iob, "i%dei%de", IPC_TYPE_ERR, IPC_ETINACTIVE);
+        else {
+            unsigned long depth = 0, npeers = 0;
+            struct peer *p;
+            BTPDQ_FOREACH(p, &tl->tp->net->peers, p_entry) {
+                if (peer_active_down(p)) {
+                    depth += p->nreqs_max;
+                    npeers++;
+                }
+            }
+            iobuf_print(iob, "i%dei%lue", IPC_TYPE_NUM,
+                npeers == 0 ? 0 : depth / npeers);
+        }
+        return;
+    case IPC_TVAL_REQTMO:
+        iobuf_print(iob, "i%dei%llue", IPC_TYPE_NUM,
+            tl->tp == NULL ? 0ULL : tl->tp->net->req_timeouts);
+        return;
+    case IPC_TVAL_REQREAS:
+        iobuf_print(iob, "i%dei%llue", IPC_TYPE_NUM,
+            tl->tp == NULL ? 0ULL : tl->tp->net->req_reassigned);
+        return;
+    case IPC_TVAL_EGDUP:
+        iobuf_print(iob, "i%dei%llue", IPC_TYPE_NUM,
+            tl->tp == NULL ? 0ULL : tl->tp->net->eg_dup_bytes);
+        return;
+    case IPC_TVAL_TESTQ:
+        iobuf_print(iob, "i%dei%ue", IPC_TYPE_NUM,
+            tl->tp == NULL ? 0 : cm_test_queue(tl->tp));
+        return;
     case IPC_TVALCOUNT:
         break;
     }
@@ -422,6 +454,83 @@ cmd_rate(struct cli *cli, int argc, const char *args)
     return write_code_buffer(cli, IPC_OK);
 }
 
+static int
+cmd_prio(struct cli *cli, int argc, const char *args)
+{
+    struct tlib *tl;
+    unsigned nfiles;
+    long long file, prio;
+
+    if (argc != 3)
+        return IPC_COMMERR;
+
+    if (benc_isstr(args) && benc_strlen(args) == 20)
+        tl = tlib_by_hash(benc_mem(args, NULL, &args));
+    else if (benc_isint(args))
+        tl = tlib_by_num(benc_int(args, &args));
+    else
+        return IPC_COMMERR;
+
+    if (benc_isint(args))
+        file = benc_int(args, &args);
+    else
+        return IPC_COMMERR;
+    if (benc_isint(args))
+        prio = benc_int(args, NULL);
+    else
+        return IPC_COMMERR;
+    if (prio < IPC_FPRIO_SKIP || prio > IPC_FPRIO_HIGH)
+        return IPC_COMMERR;
+
+    if (tl == NULL || torrent_haunting(tl))
+        return write_code_buffer(cli, IPC_ENOTENT);
+    if (torrent_active(tl))
+        nfiles = tl->tp->nfiles;
+    else {
+        char *mi;
+        if (tlib_load_mi(tl, &mi) != 0)
+            return write_code_buffer(cli, IPC_EBADTENT);
+        nfiles = mi_nfiles(mi);
+        free(mi);
+    }
+    if (file < 0 || file >= nfiles)
+        return write_code_buffer(cli, IPC_ENOFILE);
+
+    tlib_set_fprio(tl, nfiles, file, prio);
+    if (torrent_active(tl))
+        cm_update_prio(tl->tp);
+    return write_code_buffer(cli, IPC_OK);
+}
+
+static int
+cmd_stream(struct cli *cli, int argc, const char *args)
+{
+    struct tlib *tl;
+    int on;
+
+    if (argc != 2)
+        return IPC_COMMERR;
+
+    if (benc_isstr(args) && benc_strlen(args) == 20)
+        tl = tlib_by_hash(benc_mem(args, NULL, &args));
+    else if (benc_isint(args))
+        tl = tlib_by_num(benc_int(args, &args));
+    else
+        return IPC_COMMERR;
+
+    if (benc_isint(args))
+        on = benc_int(args, NULL) != 0;
+    else
+        return IPC_COMMERR;
+
+    if (tl == NULL || torrent_haunting(tl))
+        return write_code_buffer(cli, IPC_ENOTENT);
+    else if (!torrent_active(tl))
+        return write_code_buffer(cli, IPC_ETINACTIVE);
+    dl_set_stream(tl->tp->net, on);
+    return write_code_buffer(cli, IPC_OK);
+}
+
 static int
 cmd_die(struct cli *cli, int argc, const char *args)
 {
@@ -441,11 +550,13 @@ static struct {
     { "add",    3, cmd_add },
     { "del",    3, cmd_del },
     { "die",    3, cmd_die },
+    { "prio",   4, cmd_prio },
     { "rate",   4, cmd_rate },
     { "start",  5, cmd_start },
     { "start-all", 9, cmd_start_all},
     { "stop",   4, cmd_stop },
     { "stop-all", 8, cmd_stop_all},
+    { "stream", 6, cmd_stream },
     { "tget",   4, cmd_tget }
 };
 
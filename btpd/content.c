@@ -1,6 +1,7 @@
 #include "btpd.h"
 
 #include <openssl/sha.h>
+#include <sha1.h>
 #include <stream.h>
 
 struct content {
@@ -17,10 +18,29 @@ struct content {
     uint8_t *piece_field;
     uint8_t *block_field;
     uint8_t *pos_field;
+    uint8_t *test_field;
+
+    /*
+     * The priority of a piece is the highest of the priorities of the
+     * files it overlaps.
+     */
+    uint8_t *piece_prio;
+    int high_prio;
 
     struct bt_stream *rds;
     struct bt_stream *wrs;
 
+    /*
+     * The disk jobs in progress. While there are any the write stream
+     * belongs to the torrent's worker and each worker reads through a
+     * stream of its own, so they're closed only when the last is done.
+     */
+    unsigned nios;
+    struct bt_stream **dio_rds;
+
+    // Pieces waiting to be tested or being hashed.
+    unsigned ntests;
+
     struct resume_data *resd;
 };
 
@@ -35,17 +55,62 @@ fd_cb_rd(const char *path, int *fd, void *arg)
     return vopen(fd, O_RDONLY, "%s/%s", tp->tl->dir, path);
 }
 
+/*
+ * Skipped files aren't created up front, but pieces they share with
+ * other files still need to be written to them.
+ */
 static int
 fd_cb_wr(const char *path, int *fd, void *arg)
 {
     struct torrent *tp = arg;
-    return vopen(fd, O_RDWR, "%s/%s", tp->tl->dir, path);
+    return vopen(fd, O_RDWR|O_CREAT, "%s/%s", tp->tl->dir, path);
 }
 
+/*
+ * A block to write, data to read or a piece to test. Writes, tests and
+ * block hashes go to the torrent's own worker, which keeps them in order.
+ */
+struct cm_job {
+    struct dio_job dj;
+    struct torrent *tp;
+    uint32_t piece, begin;
+    uint8_t *buf;
+    uint32_t *zpcs;
+    unsigned nzpcs;
+    int err;
+    const char *errfile;
+    void (*cb)(void *, int, uint8_t *);
+    void *arg;
+    uint8_t hash[SHA_DIGEST_LENGTH];
+    BTPDQ_ENTRY(cm_job) entry;
+};
+
+BTPDQ_HEAD(cm_job_tq, cm_job);
+
+/*
+ * Pieces waiting for one of the cm_hash_threads hashing slots.
+ */
+static struct cm_job_tq m_hashq = BTPDQ_HEAD_INITIALIZER(m_hashq);
+static unsigned m_nhashing;
+
+static void cm_hash_cb(struct dio_job *dj);
+
+/*
+ * The startup test checks runs of up to STARTTEST_RUN bytes of pieces
+ * in the same hashing slots as the downloaded pieces, which go first.
+ * Torrents are tested one at a time per device, with one run at a
+ * time, so that each disk sees one stream of large sequential reads.
+ */
+#define STARTTEST_RUN (16 << 20)
+
 struct start_test_data {
     struct torrent *tp;
     struct file_time_size *fts;
     uint32_t start;
+    dev_t dev;
+    int running;
+    int stopped;
+    unsigned nruns;
     BTPDQ_ENTRY(start_test_data) entry;
 };
 
@@ -53,9 +118,14 @@ BTPDQ_HEAD(std_tq, start_test_data);
 
 static struct std_tq m_startq = BTPDQ_HEAD_INITIALIZER(m_startq);
 
-static struct timeout m_workev;
-
-#define READBUFLEN (1 << 14)
+struct start_test_run {
+    struct dio_job dj;
+    struct start_test_data *std;
+    uint32_t start, end;
+    uint8_t *hashes;
+    int err;
+    const char *errfile;
+};
 
 static int
 test_hash(struct torrent *tp, uint8_t *hash, uint32_t piece)
@@ -65,37 +135,14 @@ test_hash(struct torrent *tp, uint8_t *hash, uint32_t piece)
     return bcmp(hash, piece_hash, SHA_DIGEST_LENGTH);
 }
 
-static int
-test_piece(struct torrent *tp, uint32_t piece, int *ok)
-{
-    int err;
-    uint8_t hash[SHA_DIGEST_LENGTH];
-    if ((err = bts_sha(tp->cm->rds, piece * tp->piece_length,
-             torrent_piece_size(tp, piece), hash)) != 0) {
-        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
-            bts_filename(tp->cm->rds), strerror(err));
-        return err;;
-    }
-    *ok = test_hash(tp, hash, piece) == 0;
-    return 0;
-}
-
-static int test_hash(struct torrent *tp, uint8_t *hash, uint32_t piece);
-
-static void startup_test_run(void);
-
-void
-worker_cb(int fd, short type, void *arg)
-{
-    startup_test_run();
-}
-
 void
 cm_kill(struct torrent *tp)
 {
     struct content *cm = tp->cm;
     tlib_close_resume(cm->resd);
     free(cm->pos_field);
+    free(cm->piece_prio);
+    free(cm->dio_rds);
     free(cm);
     tp->cm = NULL;
 }
@@ -137,6 +184,80 @@ cm_write_done(struct torrent *tp)
         cm_save(tp);
 }
 
+static void startup_test_sched(void);
+
+/*
+ * Close the streams used by the disk workers, once they're done.
+ */
+static void
+cm_close(struct torrent *tp)
+{
+    struct content *cm = tp->cm;
+
+    for (int i = 0; i < dio_nthreads; i++)
+        if (cm->dio_rds[i] != NULL) {
+            bts_close(cm->dio_rds[i]);
+            cm->dio_rds[i] = NULL;
+        }
+    if (cm->wrs != NULL)
+        cm_write_done(tp);
+}
+
+static int
+cm_worker(struct torrent *tp)
+{
+    return tp->tl->num % DIO_NTHREADS;
+}
+
+static struct cm_job *
+cm_job_create(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
+    void (*fun)(struct dio_job *), void (*cb)(struct dio_job *))
+{
+    struct cm_job *job = btpd_calloc(1, sizeof(*job));
+    job->dj.fun = fun;
+    job->dj.cb = cb;
+    job->dj.len = len;
+    job->tp = tp;
+    job->piece = piece;
+    job->begin = begin;
+    return job;
+}
+
+static void
+cm_job_submit(struct cm_job *job, int worker)
+{
+    job->tp->cm->nios++;
+    dio_submit(&job->dj, worker);
+}
+
+static void
+cm_io_done(struct torrent *tp)
+{
+    struct content *cm = tp->cm;
+    if (--cm->nios == 0 && cm->state == CM_INACTIVE)
+        cm_close(tp);
+}
+
+static void
+cm_job_done(struct cm_job *job)
+{
+    struct torrent *tp = job->tp;
+
+    free(job->zpcs);
+    free(job);
+    cm_io_done(tp);
+}
+
+static void
+cm_job_error(struct cm_job *job)
+{
+    if (!job->tp->cm->error) {
+        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+            job->errfile, strerror(job->err));
+        cm_on_error(job->tp);
+    }
+}
+
 void
 cm_stop(struct torrent *tp)
 {
@@ -150,25 +271,41 @@ cm_stop(struct torrent *tp)
         BTPDQ_FOREACH(std, &m_startq, entry)
             if (std->tp == tp) {
                 BTPDQ_REMOVE(&m_startq, std, entry);
-                free(std->fts);
-                free(std);
+                // Runs in progress free it when they're done.
+                if (std->nruns > 0)
+                    std->stopped = 1;
+                else {
+                    free(std->fts);
+                    free(std);
+                }
+                startup_test_sched();
                 break;
             }
     }
 
-    if (cm->rds != NULL)
+    if (cm->rds != NULL) {
         bts_close(cm->rds);
-    if (cm->wrs != NULL)
-        cm_write_done(tp);
+        cm->rds = NULL;
+    }
+
+    struct cm_job *job, *next;
+    BTPDQ_FOREACH_MUTABLE(job, &m_hashq, entry, next)
+        if (job->tp == tp && job->dj.cb == cm_hash_cb) {
+            BTPDQ_REMOVE(&m_hashq, job, entry);
+            cm->ntests--;
+            cm_job_done(job);
+        }
 
     cm->state = CM_INACTIVE;
+    if (cm->nios == 0)
+        cm_close(tp);
 }
 
 int
 cm_active(struct torrent *tp)
 {
     struct content *cm = tp->cm;
-    return cm->state != CM_INACTIVE;
+    return cm->state != CM_INACTIVE || cm->nios > 0;
 }
 
 int
@@ -195,26 +332,158 @@ cm_create(struct torrent *tp, const char *mi)
         cm->bppbf * tp->npieces);
     cm->piece_field = resume_piece_field(cm->resd);
     cm->block_field = resume_block_field(cm->resd);
+    cm->test_field = resume_test_field(cm->resd);
+    cm->piece_prio = btpd_malloc(tp->npieces);
+    cm->dio_rds = btpd_calloc(dio_nthreads, sizeof(*cm->dio_rds));
 
     tp->cm = cm;
+    cm_update_prio(tp);
+}
+
+/*
+ * Recompute the piece priorities from the file priorities kept in the
+ * torrent's tlib entry.
+ */
+void
+cm_update_prio(struct torrent *tp)
+{
+    off_t off = 0;
+    struct content *cm = tp->cm;
+
+    memset(cm->piece_prio, IPC_FPRIO_SKIP, tp->npieces);
+    cm->high_prio = 0;
+    for (unsigned i = 0; i < tp->nfiles; i++) {
+        int prio = tlib_fprio(tp->tl, tp->nfiles, i);
+        if (prio == IPC_FPRIO_HIGH)
+            cm->high_prio = 1;
+        if (tp->files[i].length > 0) {
+            uint32_t start = off / tp->piece_length;
+            uint32_t end = (off + tp->files[i].length - 1) / tp->piece_length;
+            for (uint32_t piece = start; piece <= end; piece++)
+                cm->piece_prio[piece] = max(cm->piece_prio[piece], prio);
+        }
+        off += tp->files[i].length;
+    }
+    if (net_active(tp))
+        dl_on_prio_change(tp->net);
+}
+
+int
+cm_piece_prio(struct torrent *tp, uint32_t piece)
+{
+    return tp->cm->piece_prio[piece];
 }
 
 int
-cm_get_bytes(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
-    uint8_t **buf)
+cm_high_prio(struct torrent *tp)
+{
+    return tp->cm->high_prio;
+}
+
+static void
+cm_read_td(struct dio_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    struct bt_stream **bts = &tp->cm->dio_rds[dj->worker];
+
+    if (*bts == NULL && (job->err =
+            bts_open(bts, tp->nfiles, tp->files, fd_cb_rd, tp)) != 0) {
+        job->errfile = torrent_name(tp);
+        return;
+    }
+    if (job->buf != NULL)
+        job->err = bts_get(*bts, job->piece * tp->piece_length + job->begin,
+            job->buf, dj->len);
+    else
+        job->err = bts_warm(*bts, job->piece * tp->piece_length + job->begin,
+            dj->len);
+    if (job->err != 0)
+        job->errfile = bts_filename(*bts);
+}
+
+static void
+cm_read_cb(struct dio_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+
+    if (job->err != 0) {
+        cm_job_error(job);
+        free(job->buf);
+        job->buf = NULL;
+    }
+    job->cb(job->arg, job->err, job->buf);
+    cm_job_done(job);
+}
+
+static void
+cm_read_submit(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, uint8_t *buf, void (*cb)(void *, int, uint8_t *), void *arg)
+{
+    struct cm_job *job;
+
+    job = cm_job_create(tp, piece, begin, len, cm_read_td, cm_read_cb);
+    job->buf = buf;
+    job->cb = cb;
+    job->arg = arg;
+    cm_job_submit(job, -1);
+}
+
+/*
+ * Read torrent data on a disk worker. The callback gets the data in a
+ * buffer of its own, or the error if the read failed.
+ */
+int
+cm_fetch_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, void (*cb)(void *, int, uint8_t *), void *arg)
 {
     if (tp->cm->error)
         return EIO;
+    cm_read_submit(tp, piece, begin, len, btpd_malloc(len), cb, arg);
+    return 0;
+}
 
-    *buf = btpd_malloc(len);
-    int err =
-        bts_get(tp->cm->rds, piece * tp->piece_length + begin, *buf, len);
-    if (err != 0) {
-        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
-            bts_filename(tp->cm->rds), strerror(err));
-        cm_on_error(tp);
-    }
-    return err;
+/*
+ * Have a disk worker read torrent data into the page cache, so that it
+ * can then be sent with cm_send_bytes without waiting for the disk. The
+ * callback gets a NULL buffer, or the error if the read failed.
+ */
+int
+cm_warm_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, void (*cb)(void *, int, uint8_t *), void *arg)
+{
+    if (tp->cm->error)
+        return EIO;
+    cm_read_submit(tp, piece, begin, len, NULL, cb, arg);
+    return 0;
+}
+
+/*
+ * Send torrent data directly from the content files to a socket. This
+ * runs on the event loop, so the data should have been brought in with
+ * cm_warm_bytes first. Errors are only passed on, since they may come
+ * from either side. The caller is expected to retry with cm_fetch_bytes
+ * on anything but EAGAIN, which reports real disk errors as usual.
+ */
+int
+cm_send_bytes(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len,
+    int sd, size_t *sent)
+{
+    if (tp->cm->error)
+        return EIO;
+    return bts_send(tp->cm->rds, piece * tp->piece_length + begin, len, sd,
+        sent);
+}
+
+/*
+ * Hint that the data will soon be read or sent. Failure is harmless,
+ * the read itself will report any real problem.
+ */
+void
+cm_prefetch(struct torrent *tp, uint32_t piece, uint32_t begin, size_t len)
+{
+    if (!tp->cm->error)
+        bts_prefetch(tp->cm->rds, piece * tp->piece_length + begin, len);
 }
 
 void
@@ -226,14 +495,74 @@ cm_prealloc(struct torrent *tp, uint32_t piece)
         set_bit(cm->pos_field, piece);
 }
 
-void
-cm_test_piece(struct torrent *tp, uint32_t piece)
+static void
+cm_hash_td(struct dio_job *dj)
 {
-    int ok;
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    struct bt_stream **bts = &tp->cm->dio_rds[dj->worker];
+
+    if (*bts == NULL && (job->err =
+            bts_open(bts, tp->nfiles, tp->files, fd_cb_rd, tp)) != 0) {
+        job->errfile = torrent_name(tp);
+        return;
+    }
+    job->err = bts_sha(*bts, job->piece * tp->piece_length,
+        torrent_piece_size(tp, job->piece), job->hash);
+    if (job->err != 0)
+        job->errfile = bts_filename(*bts);
+}
+
+static struct start_test_run *startup_test_next(void);
+
+/*
+ * Fill the free hashing slots, with downloaded pieces first and then
+ * runs of the startup test.
+ */
+static void
+cm_hash_run(void)
+{
+    struct cm_job *job;
+    struct start_test_run *run;
+    while (m_nhashing < cm_hash_threads) {
+        if ((job = BTPDQ_FIRST(&m_hashq)) != NULL) {
+            BTPDQ_REMOVE(&m_hashq, job, entry);
+            m_nhashing++;
+            dio_submit(&job->dj, DIO_HASH);
+        } else if ((run = startup_test_next()) != NULL) {
+            m_nhashing++;
+            dio_submit(&run->dj, DIO_HASH);
+        } else
+            break;
+    }
+}
+
+static void
+cm_hash_cb(struct dio_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
     struct content *cm = tp->cm;
-    if ((errno = test_piece(tp, piece, &ok)) != 0)
-        cm_on_error(tp);
-    else if (ok) {
+    uint32_t piece = job->piece;
+    int ok;
+
+    m_nhashing--;
+    cm_hash_run();
+
+    cm->ntests--;
+    if (cm->state != CM_ACTIVE || cm->error) {
+        cm_job_done(job);
+        return;
+    }
+    if (job->err != 0) {
+        cm_job_error(job);
+        cm_job_done(job);
+        return;
+    }
+    ok = test_hash(tp, job->hash, piece) == 0;
+    cm_job_done(job);
+
+    if (ok) {
         assert(cm->npieces_got < tp->npieces);
         cm->npieces_got++;
         set_bit(cm->piece_field, piece);
@@ -249,58 +578,214 @@ cm_test_piece(struct torrent *tp, uint32_t piece)
     }
 }
 
+static void
+cm_test_td(struct dio_job *dj)
+{
+}
+
+/*
+ * The piece's writes are done. Queue it for hashing.
+ */
+static void
+cm_test_cb(struct dio_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct content *cm = job->tp->cm;
+
+    if (cm->state != CM_ACTIVE || cm->error) {
+        cm->ntests--;
+        cm_job_done(job);
+        return;
+    }
+    job->dj.fun = cm_hash_td;
+    job->dj.cb = cm_hash_cb;
+    BTPDQ_INSERT_TAIL(&m_hashq, job, entry);
+    cm_hash_run();
+}
+
+/*
+ * The test is first queued behind the writes of the piece on the
+ * torrent's worker. The piece is then hashed by one of the
+ * cm_hash_threads hash workers, and the result comes back as
+ * dl_on_ok_piece or dl_on_bad_piece.
+ */
+void
+cm_test_piece(struct torrent *tp, uint32_t piece)
+{
+    tp->cm->ntests++;
+    cm_job_submit(cm_job_create(tp, piece, 0, 0, cm_test_td, cm_test_cb),
+        cm_worker(tp));
+}
+
+/*
+ * The number of pieces waiting to be tested or being hashed.
+ */
+unsigned
+cm_test_queue(struct torrent *tp)
+{
+    return tp->cm->ntests;
+}
+
+static void
+cm_blocks_td(struct dio_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    const uint8_t *blocks[SHA1_MAXLANES];
+    uint32_t nblocks = torrent_piece_blocks(tp, job->piece);
+    uint32_t nfull = dj->len / PIECE_BLOCKLEN;
+    uint8_t *hashes = btpd_malloc(nblocks * SHA_DIGEST_LENGTH);
+    unsigned n;
+
+    for (uint32_t i = 0; i < nblocks; i += n) {
+        n = i < nfull ? min(nfull - i, sha1_lanes()) : 1;
+        if (n > 1) {
+            for (unsigned j = 0; j < n; j++)
+                blocks[j] = job->buf + (i + j) * PIECE_BLOCKLEN;
+            sha1_mb_hash(blocks, n, PIECE_BLOCKLEN,
+                hashes + i * SHA_DIGEST_LENGTH);
+        } else
+            SHA1(job->buf + i * PIECE_BLOCKLEN,
+                torrent_block_size(tp, job->piece, nblocks, i),
+                hashes + i * SHA_DIGEST_LENGTH);
+    }
+    free(job->buf);
+    job->buf = hashes;
+}
+
+static void
+cm_blocks_cb(struct dio_job *dj)
+{
+    m_nhashing--;
+    cm_hash_run();
+    cm_read_cb(dj);
+}
+
+/*
+ * The piece has been read behind its writes. Queue it for hashing.
+ */
+static void
+cm_blocks_read_cb(struct dio_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+
+    if (job->err != 0) {
+        cm_read_cb(dj);
+        return;
+    }
+    job->dj.fun = cm_blocks_td;
+    job->dj.cb = cm_blocks_cb;
+    BTPDQ_INSERT_TAIL(&m_hashq, job, entry);
+    cm_hash_run();
+}
+
+/*
+ * Hash each block of a piece, to tell which peers sent bad data. The
+ * piece is read on the torrent's worker, after the writes queued before
+ * it, and then hashed in one of the hashing slots. The callback gets
+ * the block hashes in a buffer of its own, or the error.
+ */
+int
+cm_hash_blocks(struct torrent *tp, uint32_t piece,
+    void (*cb)(void *, int, uint8_t *), void *arg)
+{
+    struct cm_job *job;
+    size_t len = torrent_piece_size(tp, piece);
+
+    if (tp->cm->error)
+        return EIO;
+
+    job = cm_job_create(tp, piece, 0, len, cm_read_td, cm_blocks_read_cb);
+    job->buf = btpd_malloc(len);
+    job->cb = cb;
+    job->arg = arg;
+    cm_job_submit(job, cm_worker(tp));
+    return 0;
+}
+
+static void
+cm_write_td(struct dio_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+    struct torrent *tp = job->tp;
+    struct bt_stream *wrs = tp->cm->wrs;
+
+    for (unsigned i = 0; i < job->nzpcs && job->err == 0; i++) {
+        off_t len = torrent_piece_size(tp, job->zpcs[i]);
+        off_t off = tp->piece_length * job->zpcs[i];
+        while (len > 0 && job->err == 0) {
+            size_t wlen = min(ZEROBUFLEN, len);
+            job->err = bts_put(wrs, off, m_zerobuf, wlen);
+            len -= wlen;
+            off += wlen;
+        }
+    }
+    if (job->err == 0)
+        job->err = bts_put(wrs, job->piece * tp->piece_length + job->begin,
+            job->buf, dj->len);
+    if (job->err != 0)
+        job->errfile = bts_filename(wrs);
+}
+
+static void
+cm_write_cb(struct dio_job *dj)
+{
+    struct cm_job *job = (struct cm_job *)dj;
+
+    if (job->err != 0)
+        cm_job_error(job);
+    net_inbuf_put((char *)job->buf, dj->len);
+    cm_job_done(job);
+}
+
+/*
+ * Store a block. The buffer, from net_inbuf_get, is taken over and
+ * given back once it's been written, which is done by the torrent's
+ * disk worker. The block is counted as stored right away; the piece
+ * test is queued behind the write, so it won't see the piece before
+ * it's on disk.
+ */
 int
 cm_put_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
-    const uint8_t *buf, size_t len)
+    uint8_t *buf, size_t len)
 {
-    int err;
+    struct cm_job *job;
     struct content *cm = tp->cm;
 
-    if (cm->error)
+    if (cm->error) {
+        net_inbuf_put((char *)buf, len);
         return EIO;
+    }
 
     uint8_t *bf = cm->block_field + piece * cm->bppbf;
     assert(!has_bit(bf, begin / PIECE_BLOCKLEN));
     assert(!has_bit(cm->piece_field, piece));
 
+    job = cm_job_create(tp, piece, begin, len, cm_write_td, cm_write_cb);
+    job->buf = buf;
+
+    // Decide here which pieces the write has to allocate first.
     if (!has_bit(cm->pos_field, piece)) {
         unsigned npieces = ceil((double)cm_alloc_size / tp->piece_length);
         uint32_t start = piece - piece % npieces;
         uint32_t end = min(start + npieces, tp->npieces);
 
+        job->zpcs = btpd_malloc((end - start) * sizeof(*job->zpcs));
         while (start < end) {
-            if (!has_bit(cm->pos_field, start)) {
+            if (!has_bit(cm->pos_field, start) && (start == piece
+                    || cm->piece_prio[start] != IPC_FPRIO_SKIP)) {
                 assert(!has_bit(cm->piece_field, start));
-                off_t len = torrent_piece_size(tp, start);
-                off_t off = tp->piece_length * start;
-                while (len > 0) {
-                    size_t wlen = min(ZEROBUFLEN, len);
-                    if ((err = bts_put(cm->wrs, off, m_zerobuf, wlen)) != 0) {
-                        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
-                            bts_filename(cm->wrs), strerror(errno));
-                        cm_on_error(tp);
-                        return err;
-                    }
-
-                    len -= wlen;
-                    off += wlen;
-                }
+                job->zpcs[job->nzpcs++] = start;
                 set_bit(cm->pos_field, start);
             }
             start++;
         }
     }
-    err = bts_put(cm->wrs, piece * tp->piece_length + begin, buf, len);
-    if (err != 0) {
-        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s)\n",
-            bts_filename(cm->wrs), strerror(err));
-        cm_on_error(tp);
-        return err;
-    }
 
     cm->ncontent_bytes += len;
     set_bit(bf, begin / PIECE_BLOCKLEN);
 
+    cm_job_submit(job, cm_worker(tp));
     return 0;
 }
 
@@ -350,7 +835,11 @@ stat_and_adjust(struct torrent *tp, struct file_time_size ret[])
         snprintf(path, PATH_MAX, "%s/%s", tp->tl->dir, tp->files[i].path);
 again:
         if (stat(path, &sb) == -1) {
-            if (errno == ENOENT) {
+            if (errno == ENOENT
+                    && tlib_fprio(tp->tl, tp->nfiles, i) == IPC_FPRIO_SKIP) {
+                ret[i].mtime = 0;
+                ret[i].size = 0;
+            } else if (errno == ENOENT) {
                 errno = vopen(&fd, O_CREAT|O_RDWR, "%s", path);
                 if (errno != 0 || close(fd) != 0) {
                     btpd_log(BTPD_L_ERROR, "failed to create '%s' (%s).\n",
@@ -378,11 +867,12 @@ again:
     return 0;
 }
 
-void
-startup_test_end(struct torrent *tp, int unclean)
+static void
+startup_test_end(struct torrent *tp, struct start_test_data *std)
 {
     struct content *cm = tp->cm;
 
+    bzero(cm->test_field, ceil(tp->npieces / 8.0));
     bzero(cm->pos_field, ceil(tp->npieces / 8.0));
     for (uint32_t piece = 0; piece < tp->npieces; piece++) {
         if (cm_has_piece(tp, piece)) {
@@ -407,8 +897,7 @@ startup_test_end(struct torrent *tp, int unclean)
         } else if (nblocks_got > 0)
             set_bit(cm->pos_field, piece);
     }
-    if (unclean) {
-        struct start_test_data *std = BTPDQ_FIRST(&m_startq);
+    if (std != NULL) {
         BTPDQ_REMOVE(&m_startq, std, entry);
         for (int i = 0; i < tp->nfiles; i++)
             resume_set_fts(cm->resd, i, std->fts + i);
@@ -429,40 +918,153 @@ startup_test_end(struct torrent *tp, int unclean)
     cm->state = CM_ACTIVE;
 }
 
-void
-startup_test_run(void)
+static void
+startup_test_td(struct dio_job *dj)
 {
-    int ok;
-    struct torrent *tp;
-    struct content *cm;
-    struct start_test_data * std = BTPDQ_FIRST(&m_startq);
-    uint32_t this;
-    if (std == NULL)
-        return;
-    tp = std->tp;
-    cm = tp->cm;
-    if (test_piece(std->tp, std->start, &ok) != 0) {
-        cm_on_error(std->tp);
+    struct start_test_run *run = (struct start_test_run *)dj;
+    struct torrent *tp = run->std->tp;
+    struct bt_stream *bts;
+    uint32_t piece, n, lanes = sha1_lanes();
+
+    if ((run->err = bts_open(&bts, tp->nfiles, tp->files, fd_cb_rd, tp))
+            != 0) {
+        run->errfile = torrent_name(tp);
         return;
     }
-    if (ok)
-        set_bit(cm->piece_field, std->start);
-    else
-        clear_bit(cm->piece_field, std->start);
-    this = std->start;
-    do
+    bts_sequential(bts);
+    for (piece = run->start; piece < run->end && run->err == 0; piece += n) {
+        uint8_t *hashes =
+            run->hashes + (piece - run->start) * SHA_DIGEST_LENGTH;
+        n = min(run->end - piece, lanes);
+        /* The last piece may be shorter and is hashed on its own. */
+        if (n > 1 && piece + n == tp->npieces)
+            n--;
+        if (n > 1)
+            run->err = bts_sha_mb(bts, piece * tp->piece_length,
+                tp->piece_length, n, hashes);
+        else
+            run->err = bts_sha(bts, piece * tp->piece_length,
+                torrent_piece_size(tp, piece), hashes);
+        if (run->err != 0)
+            run->errfile = bts_filename(bts);
+    }
+    bts_close(bts);
+}
+
+static void startup_test_cb(struct dio_job *dj);
+
+/*
+ * Whether the torrent has pieces left to test. std->start is moved to
+ * the first of them.
+ */
+static int
+startup_test_left(struct start_test_data *std)
+{
+    struct torrent *tp = std->tp;
+    while (std->start < tp->npieces
+            && !has_bit(tp->cm->pos_field, std->start))
         std->start++;
-    while (std->start < tp->npieces && !has_bit(cm->pos_field, std->start));
-    if (std->start >= tp->npieces)
-        startup_test_end(tp, 1);
-    if (!BTPDQ_EMPTY(&m_startq))
-        btpd_timer_add(&m_workev, (& (struct timespec) { 0, 0 }));
+    return std->start < tp->npieces;
 }
 
-void
+/*
+ * The next run for a hashing slot, from a torrent being tested that
+ * doesn't have one in progress. A run only covers pieces that are to
+ * be tested.
+ */
+static struct start_test_run *
+startup_test_next(void)
+{
+    struct start_test_data *std;
+    BTPDQ_FOREACH(std, &m_startq, entry)
+        if (std->running && std->nruns == 0 && startup_test_left(std))
+            break;
+    if (std == NULL)
+        return NULL;
+
+    struct torrent *tp = std->tp;
+    uint32_t end = std->start + 1;
+    while (end < tp->npieces && has_bit(tp->cm->pos_field, end)
+            && (end - std->start + 1) * tp->piece_length <= STARTTEST_RUN)
+        end++;
+
+    struct start_test_run *run = btpd_calloc(1, sizeof(*run));
+    run->dj.fun = startup_test_td;
+    run->dj.cb = startup_test_cb;
+    run->std = std;
+    run->start = std->start;
+    run->end = end;
+    run->hashes = btpd_malloc((end - std->start) * SHA_DIGEST_LENGTH);
+    std->start = end;
+    std->nruns++;
+    tp->cm->nios++;
+    return run;
+}
+
+/*
+ * Start testing the torrents whose devices aren't busy with another.
+ */
+static void
+startup_test_sched(void)
+{
+    struct start_test_data *std, *other;
+    BTPDQ_FOREACH(std, &m_startq, entry) {
+        if (std->running)
+            continue;
+        BTPDQ_FOREACH(other, &m_startq, entry)
+            if (other->running && other->dev == std->dev)
+                break;
+        if (other != NULL)
+            continue;
+        std->running = 1;
+    }
+    cm_hash_run();
+}
+
+static void
+startup_test_cb(struct dio_job *dj)
+{
+    struct start_test_run *run = (struct start_test_run *)dj;
+    struct start_test_data *std = run->std;
+    struct torrent *tp = std->tp;
+    struct content *cm = tp->cm;
+
+    m_nhashing--;
+    std->nruns--;
+    if (std->stopped) {
+        if (std->nruns == 0) {
+            free(std->fts);
+            free(std);
+        }
+    } else if (run->err != 0) {
+        btpd_log(BTPD_L_ERROR, "io error on '%s' (%s).\n",
+            run->errfile, strerror(run->err));
+        cm_on_error(tp);
+    } else {
+        for (uint32_t piece = run->start; piece < run->end; piece++) {
+            if (test_hash(tp, run->hashes +
+                    (piece - run->start) * SHA_DIGEST_LENGTH, piece) == 0)
+                set_bit(cm->piece_field, piece);
+            else
+                clear_bit(cm->piece_field, piece);
+            clear_bit(cm->test_field, piece);
+        }
+        if (!startup_test_left(std)) {
+            startup_test_end(tp, std);
+            startup_test_sched();
+        }
+    }
+    free(run->hashes);
+    free(run);
+    cm_io_done(tp);
+    cm_hash_run();
+}
+
+static void
 startup_test_begin(struct torrent *tp, struct file_time_size *fts)
 {
     uint32_t piece = 0;
+    struct stat sb;
     struct content *cm = tp->cm;
     while (piece < tp->npieces && !has_bit(cm->pos_field, piece))
         piece++;
@@ -471,19 +1073,27 @@ startup_test_begin(struct torrent *tp, struct file_time_size *fts)
         std->tp = tp;
         std->start = piece;
         std->fts = fts;
+        if (stat(tp->tl->dir, &sb) == 0)
+            std->dev = sb.st_dev;
         BTPDQ_INSERT_TAIL(&m_startq, std, entry);
-        if (std == BTPDQ_FIRST(&m_startq))
-            btpd_timer_add(&m_workev, (& (struct timespec) { 0, 0 }));
+        startup_test_sched();
     } else {
         free(fts);
-        startup_test_end(tp, 0);
+        startup_test_end(tp, NULL);
     }
 }
 
+/*
+ * A startup test records the file sizes and times it checks against in
+ * the resume file when it begins, and clears the pieces from the test
+ * field as they're checked. If btpd stops before the test is done, the
+ * next start continues it, as long as the files haven't changed since.
+ */
 void
 cm_start(struct torrent *tp, int force_test)
 {
-    int err, run_test = force_test;
+    int err, run_test = force_test, test_left = 0;
+    size_t pfield_size = ceil(tp->npieces / 8.0);
     struct file_time_size *fts;
     struct content *cm = tp->cm;
 
@@ -513,8 +1123,13 @@ cm_start(struct torrent *tp, int force_test)
             break;
         }
     }
+    for (size_t i = 0; i < pfield_size; i++)
+        if (cm->test_field[i] != 0) {
+            test_left = 1;
+            break;
+        }
     if (run_test) {
-        memset(cm->pos_field, 0xff, ceil(tp->npieces / 8.0));
+        memset(cm->pos_field, 0xff, pfield_size);
         off_t off = 0;
         for (int i = 0; i < tp->nfiles; i++) {
             if (fts[i].size != tp->files[i].length) {
@@ -531,13 +1146,14 @@ cm_start(struct torrent *tp, int force_test)
             }
             off += tp->files[i].length;
         }
+        for (int i = 0; i < tp->nfiles; i++)
+            resume_set_fts(cm->resd, i, fts + i);
+        bcopy(cm->pos_field, cm->test_field, pfield_size);
+    } else if (test_left) {
+        btpd_log(BTPD_L_BTPD, "Continuing the test of '%s'.\n",
+            torrent_name(tp));
+        bcopy(cm->test_field, cm->pos_field, pfield_size);
     }
 
     startup_test_begin(tp, fts);
 }
-
-void
-cm_init(void)
-{
-    evtimer_init(&m_workev, worker_cb, NULL);
-}
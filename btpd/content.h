@@ -1,8 +1,6 @@
 #ifndef BTPD_CONTENT_H
 #define BTPD_CONTENT_H
 
-void cm_init(void);
-
 void cm_create(struct torrent *tp, const char *mi);
 void cm_kill(struct torrent *tp);
 
@@ -22,12 +20,25 @@ uint8_t *cm_get_block_field(struct torrent *tp, uint32_t piece);
 
 int cm_has_piece(struct torrent *tp, uint32_t piece);
 
+void cm_update_prio(struct torrent *tp);
+int cm_piece_prio(struct torrent *tp, uint32_t piece);
+int cm_high_prio(struct torrent *tp);
+
 int cm_put_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
-    const uint8_t *buf, size_t len);
-int cm_get_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
-    size_t len, uint8_t **buf);
+    uint8_t *buf, size_t len);
+int cm_fetch_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, void (*cb)(void *, int, uint8_t *), void *arg);
+int cm_warm_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, void (*cb)(void *, int, uint8_t *), void *arg);
+int cm_send_bytes(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len, int sd, size_t *sent);
+void cm_prefetch(struct torrent *tp, uint32_t piece, uint32_t begin,
+    size_t len);
 
 void cm_prealloc(struct torrent *tp, uint32_t piece);
 void cm_test_piece(struct torrent *tp, uint32_t piece);
+unsigned cm_test_queue(struct torrent *tp);
+int cm_hash_blocks(struct torrent *tp, uint32_t piece,
+    void (*cb)(void *, int, uint8_t *), void *arg);
 
 #endif
@@ -0,0 +1,134 @@
+#include "btpd.h"
+
+#include <pthread.h>
+
+/*
+ * Disk reads and writes are done by a small pool of threads, so that a
+ * slow disk doesn't hold up the event loop. Each of the DIO_NTHREADS
+ * read and write workers has a queue of its own for jobs that must be
+ * done in order, such as the writes of a torrent, and takes jobs from
+ * a shared queue when its own is empty. The hash workers only serve
+ * the hash queue, so a long hash never holds up a torrent's writes.
+ * Finished jobs are completed on the main thread through td_post.
+ */
+
+/*
+ * Reading from peers is paused while more than DIO_MAXBACKLOG bytes
+ * wait to be read or written, and resumed when less than half of it
+ * is left.
+ */
+#define DIO_MAXBACKLOG (32 << 20)
+
+BTPDQ_HEAD(dio_job_tq, dio_job);
+
+static struct dio_job_tq m_dio_shared = BTPDQ_HEAD_INITIALIZER(m_dio_shared);
+static struct dio_job_tq m_dio_hash = BTPDQ_HEAD_INITIALIZER(m_dio_hash);
+static struct dio_job_tq *m_dio_queues;
+static pthread_mutex_t m_dio_lock;
+static pthread_cond_t m_dio_cond;
+
+unsigned dio_nthreads;
+
+static size_t m_dio_backlog;
+static int m_dio_congested;
+
+/*
+ * Queue a job. With DIO_HASH it goes to the hash workers, with any
+ * other worker below zero any read and write worker may take it, and
+ * otherwise it's done after the ones queued before it for the same
+ * worker.
+ */
+void
+dio_submit(struct dio_job *job, int worker)
+{
+    m_dio_backlog += job->len;
+    if (m_dio_backlog > DIO_MAXBACKLOG)
+        m_dio_congested = 1;
+
+    pthread_mutex_lock(&m_dio_lock);
+    if (worker == DIO_HASH)
+        BTPDQ_INSERT_TAIL(&m_dio_hash, job, entry);
+    else if (worker < 0)
+        BTPDQ_INSERT_TAIL(&m_dio_shared, job, entry);
+    else
+        BTPDQ_INSERT_TAIL(&m_dio_queues[worker % DIO_NTHREADS], job, entry);
+    pthread_mutex_unlock(&m_dio_lock);
+    pthread_cond_broadcast(&m_dio_cond);
+}
+
+int
+dio_congested(void)
+{
+    return m_dio_congested;
+}
+
+static void
+dio_td_cb(void *arg)
+{
+    struct dio_job *job = arg;
+    m_dio_backlog -= job->len;
+    job->cb(job);
+    if (m_dio_congested && m_dio_backlog < DIO_MAXBACKLOG / 2) {
+        m_dio_congested = 0;
+        net_on_dio_drain();
+    }
+}
+
+static struct dio_job *
+dio_next(int self)
+{
+    struct dio_job_tq *q;
+    if (self >= DIO_NTHREADS)
+        q = &m_dio_hash;
+    else if (!BTPDQ_EMPTY(&m_dio_queues[self]))
+        q = &m_dio_queues[self];
+    else
+        q = &m_dio_shared;
+    struct dio_job *job = BTPDQ_FIRST(q);
+    if (job != NULL)
+        BTPDQ_REMOVE(q, job, entry);
+    return job;
+}
+
+static void *
+dio_td(void *arg)
+{
+    int self = (struct dio_job_tq *)arg - m_dio_queues;
+    struct dio_job *job;
+    while (1) {
+        pthread_mutex_lock(&m_dio_lock);
+        while ((job = dio_next(self)) == NULL)
+            pthread_cond_wait(&m_dio_cond, &m_dio_lock);
+        pthread_mutex_unlock(&m_dio_lock);
+
+        job->worker = self;
+        job->fun(job);
+
+        td_post_begin();
+        td_post(dio_td_cb, job);
+        td_post_end();
+    }
+    pthread_exit(NULL);
+}
+
+static void
+errdie(int err, const char *str)
+{
+    if (err != 0)
+        btpd_err("dio_init: %s (%s).\n", str, strerror(err));
+}
+
+void
+dio_init(void)
+{
+    pthread_t td;
+    dio_nthreads = DIO_NTHREADS + cm_hash_threads;
+    m_dio_queues = btpd_calloc(dio_nthreads, sizeof(*m_dio_queues));
+    errdie(pthread_mutex_init(&m_dio_lock, NULL), "pthread_mutex_init");
+    errdie(pthread_cond_init(&m_dio_cond, NULL), "pthread_cond_init");
+    for (int i = 0; i < dio_nthreads; i++) {
+        BTPDQ_INIT(&m_dio_queues[i]);
+        errdie(pthread_create(&td, NULL, dio_td, &m_dio_queues[i]),
+            "pthread_create");
+    }
+}
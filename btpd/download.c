@@ -3,17 +3,19 @@
 /*
  * Called when a peer announces it's got a new piece.
  *
- * If the piece is missing or unfull we increase the peer's
- * wanted level and if possible call dl_on_download.
+ * If the piece is missing and not skipped, or unfull, we increase
+ * the peer's wanted level and if possible call dl_on_download.
  */
 void
 dl_on_piece_ann(struct peer *p, uint32_t index)
 {
     struct net *n = p->n;
-    n->piece_count[index]++;
-    if (cm_has_piece(n->tp, index))
+    dl_piece_count_inc(n, index);
+    if (cm_has_piece(n->tp, index) || has_bit(n->skip_field, index))
         return;
     struct piece *pc = dl_find_piece(n, index);
+    if (pc != NULL)
+        piece_add_holder(pc, p);
     if (n->endgame) {
         assert(pc != NULL);
         peer_want(p, index);
@@ -23,6 +25,7 @@ dl_on_piece_ann(struct peer *p, uint32_t index)
         peer_want(p, index);
         if (peer_leech_ok(p)) {
             pc = dl_new_piece(n, index);
+            pc->slow = dl_peer_slow(p);
             dl_piece_assign_requests(pc, p);
         }
     } else if (!piece_full(pc)) {
@@ -76,6 +79,8 @@ dl_on_ok_piece(struct net *n, uint32_t piece)
 
     btpd_log(BTPD_L_POL, "Got piece: %u.\n", pc->index);
 
+    dl_rare_remove(n, pc->index);
+
     struct net_buf *have = nb_create_have(pc->index);
     nb_hold(have);
     BTPDQ_FOREACH(p, &n->peers, p_entry)
@@ -84,8 +89,8 @@ dl_on_ok_piece(struct net *n, uint32_t piece)
     nb_drop(have);
 
     if (n->endgame)
-        BTPDQ_FOREACH(p, &n->peers, p_entry)
-            peer_unwant(p, pc->index);
+        for (unsigned i = 0; i < pc->nholders; i++)
+            peer_unwant(pc->holders[i], pc->index);
 
     piece_log_good(pc);
 
@@ -113,8 +118,9 @@ dl_on_bad_piece(struct net *n, uint32_t piece)
     piece_log_bad(pc);
 
     if (n->endgame) {
-        struct peer *p;
-        BTPDQ_FOREACH(p, &n->peers, p_entry) {
+        dl_piece_reorder_eg(pc);
+        for (unsigned i = 0; i < pc->nholders; i++) {
+            struct peer *p = pc->holders[i];
             if (peer_leech_ok(p) && peer_requestable(p, pc->index))
                 dl_assign_requests_eg(p);
         }
@@ -122,6 +128,105 @@ dl_on_bad_piece(struct net *n, uint32_t piece)
         dl_on_piece_unfull(pc);
 }
 
+static int
+rate_dwn_cmp(const void *arg1, const void *arg2)
+{
+    unsigned long rate1 = (*(struct peer **)arg1)->rate_dwn;
+    unsigned long rate2 = (*(struct peer **)arg2)->rate_dwn;
+    if (rate1 > rate2)
+        return -1;
+    else if (rate1 == rate2)
+        return 0;
+    else
+        return 1;
+}
+
+/*
+ * The number of requests for the block by peers other than p.
+ */
+static unsigned
+dl_block_nreqs(struct net *n, uint32_t index, uint32_t begin, struct peer *p)
+{
+    struct block_request *req;
+    unsigned count = 0;
+    struct piece *pc = dl_find_piece(n, index);
+    if (pc == NULL)
+        return 0;
+    BTPDQ_FOREACH(req, &pc->reqs, blk_entry)
+        if (nb_get_begin(req->msg) == begin && req->p != p)
+            count++;
+    return count;
+}
+
+/*
+ * Called when the peer has left our requests unanswered for too long.
+ * The requests are cancelled and the blocks are offered to the other
+ * peers, the fastest first. A block counts as reassigned if it got a
+ * new request from another peer; in end game it may already have had
+ * some.
+ */
+void
+dl_on_snub(struct peer *p)
+{
+    struct net *n = p->n;
+    struct block_request *req;
+    struct peer *it;
+    unsigned nblocks = 0, nfree = 0;
+    uint32_t indices[p->nreqs_out], begins[p->nreqs_out];
+    unsigned nreqs[p->nreqs_out];
+    struct peer *free_peers[n->npeers];
+
+    assert(p->nreqs_out > 0);
+    BTPDQ_FOREACH(req, &p->my_reqs, p_entry) {
+        indices[nblocks] = nb_get_index(req->msg);
+        begins[nblocks] = nb_get_begin(req->msg);
+        nreqs[nblocks] = dl_block_nreqs(n, indices[nblocks], begins[nblocks],
+            p);
+        nblocks++;
+    }
+    n->req_timeouts += nblocks;
+    peer_cancel_reqs(p);
+    dl_on_undownload(p);
+
+    BTPDQ_FOREACH(it, &n->peers, p_entry)
+        if (peer_leech_ok(it))
+            free_peers[nfree++] = it;
+    qsort(free_peers, nfree, sizeof(free_peers[0]), rate_dwn_cmp);
+    for (unsigned i = 0; i < nfree; i++)
+        if (peer_leech_ok(free_peers[i]))
+            dl_on_download(free_peers[i]);
+
+    for (unsigned i = 0; i < nblocks; i++)
+        if (dl_block_nreqs(n, indices[i], begins[i], p) > nreqs[i])
+            n->req_reassigned++;
+}
+
+/*
+ * Turn stream mode on or off. When it's turned on the peers we can
+ * download from, the fastest first, are put on the stream window.
+ */
+void
+dl_set_stream(struct net *n, int on)
+{
+    struct peer *p;
+    unsigned nfree = 0;
+    struct peer *free_peers[n->npeers];
+
+    n->stream = on;
+    n->stream_head = 0;
+    n->stream_t = btpd_seconds;
+    if (!on)
+        return;
+
+    BTPDQ_FOREACH(p, &n->peers, p_entry)
+        if (peer_leech_ok(p))
+            free_peers[nfree++] = p;
+    qsort(free_peers, nfree, sizeof(free_peers[0]), rate_dwn_cmp);
+    for (unsigned i = 0; i < nfree; i++)
+        if (peer_leech_ok(free_peers[i]))
+            dl_on_download(free_peers[i]);
+}
+
 void
 dl_on_new_peer(struct peer *p)
 {
@@ -131,10 +236,14 @@ void
 dl_on_lost_peer(struct peer *p)
 {
     struct net *n = p->n;
+    struct piece *pc;
 
     for (uint32_t i = 0; i < n->tp->npieces; i++)
         if (peer_has(p, i))
-            n->piece_count[i]--;
+            dl_piece_count_dec(n, i);
+    BTPDQ_FOREACH(pc, &n->getlst, entry)
+        if (peer_has(p, pc->index))
+            piece_del_holder(pc, p);
 
     if (p->nreqs_out > 0)
         dl_on_undownload(p);
@@ -142,7 +251,7 @@ dl_on_lost_peer(struct peer *p)
 
 void
 dl_on_block(struct peer *p, struct block_request *req,
-    uint32_t index, uint32_t begin, uint32_t length, const uint8_t *data)
+    uint32_t index, uint32_t begin, uint32_t length, uint8_t *data)
 {
     struct net *n = p->n;
     struct piece *pc = dl_find_piece(n, index);
@@ -163,6 +272,7 @@ dl_on_block(struct peer *p, struct block_request *req,
             }
         }
         nb_drop(cancel);
+        pc->eg_nreqs[begin / PIECE_BLOCKLEN] = 0;
         dl_piece_reorder_eg(pc);
         BTPDQ_FOREACH_MUTABLE(req, &pc->reqs, blk_entry, next) {
             if (nb_get_begin(req->msg) != begin)
@@ -180,7 +290,6 @@ dl_on_block(struct peer *p, struct block_request *req,
         nb_drop(req->msg);
         free(req);
         pc->nreqs--;
-        // XXX: Needs to be looked at if we introduce snubbing.
         clear_bit(pc->down_field, begin / PIECE_BLOCKLEN);
         pc->nbusy--;
         if (pc->ngot == pc->nblocks)
@@ -5,13 +5,21 @@
 
 int piece_full(struct piece *pc);
 void piece_free(struct piece *pc);
+void piece_add_holder(struct piece *pc, struct peer *p);
+void piece_del_holder(struct piece *pc, struct peer *p);
 
 void piece_log_bad(struct piece *pc);
 void piece_log_good(struct piece *pc);
 void piece_log_block(struct piece *pc, struct peer *p, uint32_t begin);
 
 void dl_on_piece_unfull(struct piece *pc);
+void dl_on_prio_change(struct net *n);
 
+void dl_piece_count_inc(struct net *n, uint32_t index);
+void dl_piece_count_dec(struct net *n, uint32_t index);
+void dl_rare_remove(struct net *n, uint32_t index);
+
+int dl_peer_slow(struct peer *p);
 struct piece *dl_new_piece(struct net *n, uint32_t index);
 struct piece *dl_find_piece(struct net *n, uint32_t index);
 unsigned dl_piece_assign_requests(struct piece *pc, struct peer *p);
@@ -30,9 +38,11 @@ void dl_on_choke(struct peer *p);
 void dl_on_unchoke(struct peer *p);
 void dl_on_download(struct peer *p);
 void dl_on_undownload(struct peer *p);
+void dl_on_snub(struct peer *p);
+void dl_set_stream(struct net *n, int on);
 void dl_on_piece_ann(struct peer *p, uint32_t index);
 void dl_on_block(struct peer *p, struct block_request *req,
-    uint32_t index, uint32_t begin, uint32_t length, const uint8_t *data);
+    uint32_t index, uint32_t begin, uint32_t length, uint8_t *data);
 
 void dl_on_ok_piece(struct net *n, uint32_t piece);
 void dl_on_bad_piece(struct net *n, uint32_t piece);
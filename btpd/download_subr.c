@@ -2,7 +2,7 @@
  * The commandments:
  *
  * A peer is wanted except when it only has pieces we've already
- * downloaded or fully requested. Thus, a peer's wanted count is
+ * downloaded, fully requested or skip. Thus, a peer's wanted count is
  * increased for each missing or unfull piece it announces, or
  * when a piece it has becomes unfull.
  *
@@ -24,6 +24,12 @@
 #include <openssl/sha.h>
 #include <stream.h>
 
+#define MAXPARTIALSLACK 8
+
+#define STREAMWINDOW (16 << 20)
+#define STREAMMINPIECES 4
+#define STREAMDEADLINE 2
+
 static void
 piece_new_log(struct piece *pc)
 {
@@ -32,40 +38,58 @@ piece_new_log(struct piece *pc)
     BTPDQ_INSERT_HEAD(&pc->logs, log, entry);
 }
 
+/*
+ * A log that's freed while its blocks are being hashed is only marked
+ * as orphaned, and is freed when the hashes come.
+ */
 static void
-piece_log_hashes(struct piece *pc)
-{
-    uint8_t *buf;
-    struct torrent *tp = pc->n->tp;
-    struct blog *log = BTPDQ_FIRST(&pc->logs);
-    log->hashes = btpd_malloc(20 * pc->nblocks);
-    for (unsigned i = 0; i < pc->nblocks; i++) {
-        uint32_t bsize = torrent_block_size(tp, pc->index, pc->nblocks, i);
-        cm_get_bytes(tp, pc->index, i * PIECE_BLOCKLEN, bsize, &buf);
-        SHA1(buf, bsize, &log->hashes[i * 20]);
-        free(buf);
-    }
-}
-
-static void
-piece_log_free(struct piece *pc, struct blog *log)
+piece_log_free(struct net *n, struct blog *log)
 {
     struct blog_record *r, *rnext;
     BTPDQ_FOREACH_MUTABLE(r, &log->records, entry, rnext) {
-        mp_drop(r->mp, pc->n);
+        mp_drop(r->mp, n);
         free(r);
     }
-    if (log->hashes != NULL)
-        free(log->hashes);
+    BTPDQ_INIT(&log->records);
+    if (log->hashing) {
+        log->orphan = 1;
+        return;
+    }
+    free(log->hashes);
     free(log);
 }
 
+static void
+piece_log_hashed(void *arg, int err, uint8_t *hashes)
+{
+    struct blog *log = arg;
+    log->hashing = 0;
+    if (log->orphan) {
+        free(hashes);
+        free(log);
+    } else
+        log->hashes = hashes;
+}
+
+/*
+ * Have the blocks of the bad piece hashed by the disk workers, so they
+ * can be checked against the good piece later. The hashes stay NULL if
+ * they can't be had.
+ */
+static void
+piece_log_hashes(struct piece *pc, struct blog *log)
+{
+    log->hashing = 1;
+    if (cm_hash_blocks(pc->n->tp, pc->index, piece_log_hashed, log) != 0)
+        log->hashing = 0;
+}
+
 static void
 piece_kill_logs(struct piece *pc)
 {
     struct blog *log, *lnext;
     BTPDQ_FOREACH_MUTABLE(log, &pc->logs, entry, lnext)
-        piece_log_free(pc, log);
+        piece_log_free(pc->n, log);
     BTPDQ_INIT(&pc->logs);
 }
 
@@ -89,7 +113,7 @@ piece_log_bad(struct piece *pc)
             peer_unwant(culprit->p, pc->index);
         net_ban_peer(pc->n, culprit);
         BTPDQ_REMOVE(&pc->logs, log, entry);
-        piece_log_free(pc, log);
+        piece_log_free(pc->n, log);
     } else {
         BTPDQ_FOREACH(r, &log->records, entry) {
             if (r->mp->p != NULL) {
@@ -98,39 +122,81 @@ piece_log_bad(struct piece *pc)
                 peer_bad_piece(r->mp->p, pc->index);
             }
         }
-        piece_log_hashes(pc);
+        piece_log_hashes(pc, log);
     }
     piece_new_log(pc);
 }
 
-void
-piece_log_good(struct piece *pc)
+struct blog_check {
+    struct net *n;
+    uint32_t index;
+    uint32_t nblocks;
+    struct blog_tq bad;
+};
+
+/*
+ * The blocks of the good piece have been hashed. The peers of the bad
+ * logs that sent a block that differs are banned, the others are
+ * cleared. A bad log without hashes can't tell, so its peers are
+ * given the benefit of the doubt.
+ */
+static void
+piece_log_check(void *arg, int err, uint8_t *hashes)
 {
+    struct blog_check *c = arg;
+    struct blog *bad, *next;
     struct blog_record *r;
-    struct blog *log = BTPDQ_FIRST(&pc->logs), *bad = BTPDQ_NEXT(log, entry);
-
-    BTPDQ_FOREACH(r, &log->records, entry)
-        if (r->mp->p != NULL)
-            peer_good_piece(r->mp->p, pc->index);
 
-    if (bad != NULL)
-        piece_log_hashes(pc);
-
-    while (bad != NULL) {
+    BTPDQ_FOREACH_MUTABLE(bad, &c->bad, entry, next) {
         BTPDQ_FOREACH(r, &bad->records, entry) {
             int culprit = 0;
-            for (unsigned i = 0; i < pc->nblocks && !culprit; i++)
+            if (!c->n->active)
+                break;
+            for (unsigned i = 0; i < c->nblocks && !culprit
+                     && hashes != NULL && bad->hashes != NULL; i++)
                 if (has_bit(r->down_field, i) && (
-                        bcmp(&log->hashes[i*20], &bad->hashes[i*20], 20) != 0))
+                        bcmp(&hashes[i*20], &bad->hashes[i*20], 20) != 0))
                     culprit = 1;
             if (culprit)
-                net_ban_peer(pc->n, r->mp);
+                net_ban_peer(c->n, r->mp);
             else if (r->mp->p != NULL)
-                peer_good_piece(r->mp->p, pc->index);
+                peer_good_piece(r->mp->p, c->index);
         }
+        piece_log_free(c->n, bad);
+    }
+    free(hashes);
+    free(c);
+}
+
+/*
+ * The bad logs are taken from the piece, which is freed next, and are
+ * checked once the blocks of the good piece have been hashed.
+ */
+void
+piece_log_good(struct piece *pc)
+{
+    struct blog_record *r;
+    struct blog *log = BTPDQ_FIRST(&pc->logs), *bad;
+    struct blog_check *c;
 
-        bad = BTPDQ_NEXT(bad, entry);
+    BTPDQ_FOREACH(r, &log->records, entry)
+        if (r->mp->p != NULL)
+            peer_good_piece(r->mp->p, pc->index);
+
+    if (BTPDQ_NEXT(log, entry) == NULL)
+        return;
+
+    c = btpd_calloc(1, sizeof(*c));
+    c->n = pc->n;
+    c->index = pc->index;
+    c->nblocks = pc->nblocks;
+    BTPDQ_INIT(&c->bad);
+    while ((bad = BTPDQ_NEXT(log, entry)) != NULL) {
+        BTPDQ_REMOVE(&pc->logs, bad, entry);
+        BTPDQ_INSERT_TAIL(&c->bad, bad, entry);
     }
+    if (cm_hash_blocks(pc->n->tp, pc->index, piece_log_check, c) != 0)
+        piece_log_check(c, EIO, NULL);
 }
 
 void
@@ -153,6 +219,63 @@ piece_log_block(struct piece *pc, struct peer *p, uint32_t begin)
     set_bit(r->down_field, begin / PIECE_BLOCKLEN);
 }
 
+static void
+dl_piece_insert_eg(struct piece *pc)
+{
+    if (pc->nblocks == pc->ngot)
+        pc->eg_bkt = -1;
+    else {
+        unsigned r = pc->nreqs / (pc->nblocks - pc->ngot);
+        pc->eg_bkt = min(r, MAXEGREQS);
+        BTPDQ_INSERT_TAIL(&pc->n->eg_bkts[pc->eg_bkt], pc, eg_entry);
+    }
+}
+
+static void
+dl_piece_remove_eg(struct piece *pc)
+{
+    if (pc->eg_bkt >= 0)
+        BTPDQ_REMOVE(&pc->n->eg_bkts[pc->eg_bkt], pc, eg_entry);
+    pc->eg_bkt = -1;
+}
+
+void
+dl_piece_reorder_eg(struct piece *pc)
+{
+    dl_piece_remove_eg(pc);
+    dl_piece_insert_eg(pc);
+}
+
+/*
+ * The peers that have an active piece are kept with it, so changes
+ * in the piece's state only concern them and not the whole swarm.
+ * A peer is added when the piece starts or when it announces the
+ * piece later, and removed when it's lost.
+ */
+void
+piece_add_holder(struct piece *pc, struct peer *p)
+{
+    if (pc->nholders == pc->holders_cap) {
+        pc->holders_cap = pc->holders_cap == 0 ? 8 : pc->holders_cap * 2;
+        pc->holders = btpd_realloc(pc->holders,
+            pc->holders_cap * sizeof(*pc->holders));
+    }
+    pc->holders[pc->nholders] = p;
+    pc->nholders++;
+}
+
+void
+piece_del_holder(struct piece *pc, struct peer *p)
+{
+    for (unsigned i = 0; i < pc->nholders; i++) {
+        if (pc->holders[i] == p) {
+            pc->nholders--;
+            pc->holders[i] = pc->holders[pc->nholders];
+            return;
+        }
+    }
+}
+
 static struct piece *
 piece_alloc(struct net *n, uint32_t index)
 {
@@ -185,11 +308,17 @@ piece_alloc(struct net *n, uint32_t index)
     BTPDQ_INIT(&pc->reqs);
     BTPDQ_INIT(&pc->logs);
 
+    struct peer *p;
+    BTPDQ_FOREACH(p, &n->peers, p_entry)
+        if (peer_has(p, index))
+            piece_add_holder(pc, p);
+
     piece_new_log(pc);
 
     n->npcs_busy++;
     set_bit(n->busy_field, index);
     BTPDQ_INSERT_TAIL(&n->getlst, pc, entry);
+    pctbl_insert(n->pctbl, pc);
     return pc;
 }
 
@@ -202,16 +331,21 @@ piece_free(struct piece *pc)
     n->npcs_busy--;
     clear_bit(n->busy_field, pc->index);
     BTPDQ_REMOVE(&pc->n->getlst, pc, entry);
+    pctbl_remove(n->pctbl, &pc->index);
     BTPDQ_FOREACH_MUTABLE(req, &pc->reqs, blk_entry, next) {
         nb_drop(req->msg);
         free(req);
     }
     piece_kill_logs(pc);
+    if (pc->holders != NULL)
+        free(pc->holders);
     if (pc->eg_reqs != NULL) {
+        dl_piece_remove_eg(pc);
         for (uint32_t i = 0; i < pc->nblocks; i++)
             if (pc->eg_reqs[i] != NULL)
                 nb_drop(pc->eg_reqs[i]);
         free(pc->eg_reqs);
+        free(pc->eg_nreqs);
     }
     free(pc);
 }
@@ -226,7 +360,8 @@ static int
 dl_should_enter_endgame(struct net *n)
 {
     int should;
-    if (cm_pieces(n->tp) + n->npcs_busy == n->tp->npieces) {
+    if ((n->npcs_busy > 0 && cm_pieces(n->tp) + n->npcs_busy
+            + n->npcs_skip == n->tp->npieces)) {
         should = 1;
         struct piece *pc;
         BTPDQ_FOREACH(pc, &n->getlst, entry) {
@@ -240,32 +375,30 @@ dl_should_enter_endgame(struct net *n)
     return should;
 }
 
+/*
+ * Put a started piece in end game mode. All its missing blocks are
+ * counted as unrequested and are wanted from the peers that have it.
+ */
 static void
-dl_piece_insert_eg(struct piece *pc)
+dl_piece_enter_eg(struct piece *pc)
 {
-    struct piece_tq *getlst = &pc->n->getlst;
-    if (pc->nblocks == pc->ngot)
-        BTPDQ_INSERT_TAIL(getlst, pc, entry);
-    else {
-        unsigned r = pc->nreqs / (pc->nblocks - pc->ngot);
-        struct piece *it;
-        BTPDQ_FOREACH(it, getlst, entry) {
-            if ((it->nblocks == it->ngot
-                    || r < it->nreqs / (it->nblocks - it->ngot))) {
-                BTPDQ_INSERT_BEFORE(it, pc, entry);
-                break;
-            }
+    struct block_request *req;
+    for (unsigned i = 0; i < pc->nblocks; i++)
+        clear_bit(pc->down_field, i);
+    pc->nbusy = 0;
+    pc->eg_reqs = btpd_calloc(pc->nblocks, sizeof(struct net_buf *));
+    pc->eg_nreqs = btpd_calloc(pc->nblocks, sizeof(*pc->eg_nreqs));
+    BTPDQ_FOREACH(req, &pc->reqs, blk_entry) {
+        uint32_t blki = nb_get_begin(req->msg) / PIECE_BLOCKLEN;
+        if (pc->eg_reqs[blki] == NULL) {
+            pc->eg_reqs[blki] = req->msg;
+            nb_hold(req->msg);
         }
-        if (it == NULL)
-            BTPDQ_INSERT_TAIL(getlst, pc, entry);
+        pc->eg_nreqs[blki]++;
     }
-}
-
-void
-dl_piece_reorder_eg(struct piece *pc)
-{
-    BTPDQ_REMOVE(&pc->n->getlst, pc, entry);
     dl_piece_insert_eg(pc);
+    for (unsigned i = 0; i < pc->nholders; i++)
+        peer_want(pc->holders[i], pc->index);
 }
 
 static void
@@ -273,105 +406,208 @@ dl_enter_endgame(struct net *n)
 {
     struct peer *p;
     struct piece *pc;
-    struct piece *pcs[n->npcs_busy];
-    unsigned pi;
+
+    BTPDQ_FOREACH(p, &n->peers, p_entry)
+        assert(p->nwant == 0);
 
     btpd_log(BTPD_L_POL, "Entering end game\n");
     n->endgame = 1;
 
-    pi = 0;
-    BTPDQ_FOREACH(pc, &n->getlst, entry) {
-        struct block_request *req;
-        for (unsigned i = 0; i < pc->nblocks; i++)
-            clear_bit(pc->down_field, i);
-        pc->nbusy = 0;
-        pc->eg_reqs = btpd_calloc(pc->nblocks, sizeof(struct net_buf *));
-        BTPDQ_FOREACH(req, &pc->reqs, blk_entry) {
-            uint32_t blki = nb_get_begin(req->msg) / PIECE_BLOCKLEN;
-            if (pc->eg_reqs[blki] == NULL) {
-                pc->eg_reqs[blki] = req->msg;
-                nb_hold(req->msg);
-            }
-        }
-        pcs[pi] = pc;
-        pi++;
-    }
-    BTPDQ_INIT(&n->getlst);
-    while (pi > 0) {
-        pi--;
-        dl_piece_insert_eg(pcs[pi]);
-    }
-    BTPDQ_FOREACH(p, &n->peers, p_entry) {
-        assert(p->nwant == 0);
-        BTPDQ_FOREACH(pc, &n->getlst, entry)
-            peer_want(p, pc->index);
+    BTPDQ_FOREACH(pc, &n->getlst, entry)
+        dl_piece_enter_eg(pc);
+    BTPDQ_FOREACH(p, &n->peers, p_entry)
         if (peer_leech_ok(p))
             dl_assign_requests_eg(p);
-    }
 }
 
 struct piece *
 dl_find_piece(struct net *n, uint32_t index)
 {
-    struct piece *pc;
-    BTPDQ_FOREACH(pc, &n->getlst, entry)
-        if (pc->index == index)
-            break;
-    return pc;
+    return pctbl_find(n->pctbl, &index);
 }
 
 static int
 dl_piece_startable(struct peer *p, uint32_t index)
 {
     return peer_requestable(p, index) && !cm_has_piece(p->n->tp, index)
-        && !has_bit(p->n->busy_field, index);
+        && !has_bit(p->n->busy_field, index)
+        && !has_bit(p->n->skip_field, index);
+}
+
+static uint32_t
+dl_rare_end(struct rare_index *ri, unsigned c)
+{
+    return c + 1 < ri->cap ? ri->start[c + 1] : ri->n;
+}
+
+static void
+dl_rare_swap(struct net *n, struct rare_index *ri, uint32_t pos1,
+    uint32_t pos2)
+{
+    uint32_t i1 = ri->pcs[pos1], i2 = ri->pcs[pos2];
+    ri->pcs[pos1] = i2;
+    n->rare_pos[i2] = pos1;
+    ri->pcs[pos2] = i1;
+    n->rare_pos[i1] = pos2;
+}
+
+static struct rare_index *
+dl_rare_index(struct net *n, uint32_t index)
+{
+    return &n->rare[has_bit(n->rare_high, index) ? 1 : 0];
+}
+
+/*
+ * Take a piece out of its index, by walking it up through the buckets
+ * above its own to the end.
+ */
+void
+dl_rare_remove(struct net *n, uint32_t index)
+{
+    struct rare_index *ri = dl_rare_index(n, index);
+    if (n->rare_pos[index] == RARE_NONE)
+        return;
+    for (unsigned c = n->piece_count[index]; c < ri->cap; c++) {
+        dl_rare_swap(n, ri, n->rare_pos[index], dl_rare_end(ri, c) - 1);
+        if (c + 1 < ri->cap)
+            ri->start[c + 1]--;
+        else
+            ri->n--;
+    }
+    n->rare_pos[index] = RARE_NONE;
+}
+
+/*
+ * Make sure there are buckets for pieces with count c + 1.
+ */
+static void
+dl_rare_reserve(struct rare_index *ri, unsigned c)
+{
+    unsigned ncap = ri->cap;
+    while (c + 2 >= ncap)
+        ncap *= 2;
+    if (ncap == ri->cap)
+        return;
+    ri->start = btpd_realloc(ri->start, ncap * sizeof(*ri->start));
+    for (unsigned i = ri->cap; i < ncap; i++)
+        ri->start[i] = ri->n;
+    ri->cap = ncap;
+}
+
+/*
+ * Put a piece in the index for its priority, by adding it at the end
+ * and walking it down through the buckets above its own.
+ */
+static void
+dl_rare_insert(struct net *n, uint32_t index)
+{
+    unsigned c = n->piece_count[index];
+    int high = cm_piece_prio(n->tp, index) == IPC_FPRIO_HIGH;
+    struct rare_index *ri = &n->rare[high];
+    if (high)
+        set_bit(n->rare_high, index);
+    else
+        clear_bit(n->rare_high, index);
+    dl_rare_reserve(ri, c);
+    ri->pcs[ri->n] = index;
+    n->rare_pos[index] = ri->n;
+    ri->n++;
+    for (unsigned b = ri->cap - 1; b > c; b--) {
+        dl_rare_swap(n, ri, n->rare_pos[index], ri->start[b]);
+        ri->start[b]++;
+    }
+}
+
+/*
+ * Keep a piece in the index it belongs in. Pieces we have or skip
+ * are in neither.
+ */
+static void
+dl_rare_update(struct net *n, uint32_t index)
+{
+    int in = n->rare_pos[index] != RARE_NONE;
+    int want = !cm_has_piece(n->tp, index)
+        && !has_bit(n->skip_field, index);
+    int high = cm_piece_prio(n->tp, index) == IPC_FPRIO_HIGH;
+    if (in && (!want || high != (has_bit(n->rare_high, index) != 0)))
+        dl_rare_remove(n, index);
+    if (want && n->rare_pos[index] == RARE_NONE)
+        dl_rare_insert(n, index);
+}
+
+void
+dl_piece_count_inc(struct net *n, uint32_t index)
+{
+    struct rare_index *ri = dl_rare_index(n, index);
+    unsigned c = n->piece_count[index];
+    n->piece_count[index]++;
+    if (n->rare_pos[index] == RARE_NONE)
+        return;
+    dl_rare_reserve(ri, c);
+    dl_rare_swap(n, ri, n->rare_pos[index], ri->start[c + 1] - 1);
+    ri->start[c + 1]--;
+}
+
+void
+dl_piece_count_dec(struct net *n, uint32_t index)
+{
+    struct rare_index *ri = dl_rare_index(n, index);
+    unsigned c = n->piece_count[index];
+    assert(c > 0);
+    n->piece_count[index]--;
+    if (n->rare_pos[index] == RARE_NONE)
+        return;
+    dl_rare_swap(n, ri, n->rare_pos[index], ri->start[c]);
+    ri->start[c]++;
+}
+
+/*
+ * Look for a startable piece in the rarest bucket that has one. Each
+ * bucket is searched from a random position, so the first startable
+ * piece found is a random one of the bucket's. When most pieces are
+ * startable that takes a few looks however large the bucket is.
+ */
+static int
+dl_rare_find(struct peer *p, struct rare_index *ri, uint32_t *res)
+{
+    for (unsigned c = 1; c < ri->cap; c++) {
+        uint32_t start = ri->start[c];
+        uint32_t size = dl_rare_end(ri, c) - start;
+        if (size == 0)
+            continue;
+        uint32_t off = random() % size;
+        for (uint32_t k = 0; k < size; k++) {
+            uint32_t i = ri->pcs[start + (off + k) % size];
+            if (dl_piece_startable(p, i)) {
+                *res = i;
+                return 0;
+            }
+        }
+    }
+    return ENOENT;
 }
 
 /*
  * Find the rarest piece the peer has, that isn't already allocated
  * for download or already downloaded. If no such piece can be found
- * return ENOENT.
+ * return ENOENT. Ties are broken randomly.
+ *
+ * High priority pieces have an index of their own, so the rarest of
+ * them is chosen if the peer has any, and otherwise the rarest other
+ * piece.
  *
  * Return 0 or ENOENT, index in res.
  */
 static int
 dl_choose_rarest(struct peer *p, uint32_t *res)
 {
-    uint32_t i;
     struct net *n = p->n;
 
     assert(n->endgame == 0);
 
-    for (i = 0; i < n->tp->npieces && !dl_piece_startable(p, i); i++)
-        ;
-
-    if (i == n->tp->npieces)
-        return ENOENT;
-
-    uint32_t min_i = i;
-    uint32_t min_c = 1;
-    for(i++; i < n->tp->npieces; i++) {
-        if (dl_piece_startable(p, i)) {
-            if (n->piece_count[i] == n->piece_count[min_i])
-                min_c++;
-            else if (n->piece_count[i] < n->piece_count[min_i]) {
-                min_i = i;
-                min_c = 1;
-            }
-        }
-    }
-    if (min_c > 1) {
-        min_c = rand_between(1, min_c);
-        for (i = min_i; min_c > 0; i++) {
-            if (dl_piece_startable(p, i)
-                && n->piece_count[i] == n->piece_count[min_i]) {
-                min_c--;
-                min_i = i;
-            }
-        }
-    }
-    *res = min_i;
-    return 0;
+    if (dl_rare_find(p, &n->rare[1], res) == 0)
+        return 0;
+    return dl_rare_find(p, &n->rare[0], res);
 }
 
 /*
@@ -382,9 +618,8 @@ dl_choose_rarest(struct peer *p, uint32_t *res)
 static void
 dl_on_piece_full(struct piece *pc)
 {
-    struct peer *p;
-    BTPDQ_FOREACH(p, &pc->n->peers, p_entry)
-        peer_unwant(p, pc->index);
+    for (unsigned i = 0; i < pc->nholders; i++)
+        peer_unwant(pc->holders[i], pc->index);
     if (dl_should_enter_endgame(pc->n))
         dl_enter_endgame(pc->n);
 }
@@ -397,6 +632,62 @@ dl_new_piece(struct net *n, uint32_t index)
     return piece_alloc(n, index);
 }
 
+/*
+ * Called when the piece priorities may have changed. The missing
+ * pieces that are skipped and not started are made unwanted, and the
+ * ones no longer skipped are made wanted again. In end game those are
+ * started at once, since every missing piece must be busy then.
+ */
+void
+dl_on_prio_change(struct net *n)
+{
+    struct peer *p;
+    struct torrent *tp = n->tp;
+    size_t len = ceil(tp->npieces / 8.0);
+    uint8_t *want = btpd_calloc(2, len), *unwant = want + len;
+    int nwant = 0, nunwant = 0;
+
+    for (uint32_t i = 0; i < tp->npieces; i++) {
+        int skip = cm_piece_prio(tp, i) == IPC_FPRIO_SKIP
+            && !cm_has_piece(tp, i) && !has_bit(n->busy_field, i);
+        if (skip == (has_bit(n->skip_field, i) != 0))
+            continue;
+        if (skip) {
+            set_bit(n->skip_field, i);
+            n->npcs_skip++;
+            set_bit(unwant, i);
+            nunwant++;
+        } else {
+            clear_bit(n->skip_field, i);
+            n->npcs_skip--;
+            if (n->endgame)
+                dl_piece_enter_eg(dl_new_piece(n, i));
+            else {
+                set_bit(want, i);
+                nwant++;
+            }
+        }
+    }
+    // Each peer's want level is changed once for all the pieces.
+    if (nwant > 0 || nunwant > 0)
+        BTPDQ_FOREACH(p, &n->peers, p_entry) {
+            if (nwant > 0)
+                peer_want_field(p, want, 1);
+            if (nunwant > 0)
+                peer_want_field(p, unwant, 0);
+        }
+    free(want);
+    for (uint32_t i = 0; i < tp->npieces; i++)
+        dl_rare_update(n, i);
+
+    if (!n->endgame && dl_should_enter_endgame(n))
+        dl_enter_endgame(n);
+    else
+        BTPDQ_FOREACH(p, &n->peers, p_entry)
+            if (peer_leech_ok(p))
+                dl_on_download(p);
+}
+
 /*
  * Called when a previously full piece loses a peer.
  * This is needed because we have decreased the wanted
@@ -408,15 +699,13 @@ void
 dl_on_piece_unfull(struct piece *pc)
 {
     struct net *n = pc->n;
-    struct peer *p;
     assert(!piece_full(pc) && n->endgame == 0);
-    BTPDQ_FOREACH(p, &n->peers, p_entry)
-        peer_want(p, pc->index);
-    p = BTPDQ_FIRST(&n->peers);
-    while (p != NULL && !piece_full(pc)) {
+    for (unsigned i = 0; i < pc->nholders; i++)
+        peer_want(pc->holders[i], pc->index);
+    for (unsigned i = 0; i < pc->nholders && !piece_full(pc); i++) {
+        struct peer *p = pc->holders[i];
         if (peer_leech_ok(p) && peer_requestable(p, pc->index))
             dl_piece_assign_requests(pc, p); // Cannot provoke end game here.
-        p = BTPDQ_NEXT(p, p_entry);
     }
 }
 
@@ -442,7 +731,8 @@ dl_new_request(struct peer *p, struct piece *pc, struct net_buf *msg)
     if (!pc->n->endgame) {
         set_bit(pc->down_field, pc->next_block);
         pc->nbusy++;
-    }
+    } else
+        pc->eg_nreqs[pc->next_block]++;
     peer_request(p, req);
     return req;
 }
@@ -474,25 +764,43 @@ dl_piece_assign_requests(struct piece *pc, struct peer *p)
 }
 
 /*
- * Request as many blocks as possible from the peer. Puts
- * requests on already active pieces before starting on new
- * ones. Care must be taken since end game mode may be triggered
- * by the calls to dl_piece_assign_requests.
- *
- * Returns number of requests sent.
- *
- * XXX: should do something smart when deciding on which
- *      already started piece to put requests on.
+ * A peer is slow if it gives us less than half the average rate of
+ * the peers we're downloading from. Pieces remember the class of the
+ * peer that started them.
  */
-unsigned
-dl_assign_requests(struct peer *p)
+int
+dl_peer_slow(struct peer *p)
+{
+    struct net *n = p->n;
+    return n->npeers_dwn > 0 && p->rate_dwn * 2 < n->rate_dwn / n->npeers_dwn;
+}
+
+/*
+ * Peers don't start new pieces when there are more than this many
+ * partial pieces, which is enough to fill the pipelines of the peers
+ * we're downloading from with some slack for new peers.
+ */
+static uint32_t
+dl_max_partial(struct net *n)
+{
+    return n->npcs_pipe + MAXPARTIALSLACK;
+}
+
+/*
+ * Put requests on the started pieces. If slow_only is set the pieces
+ * started by fast peers are left for them to finish.
+ */
+static unsigned
+dl_assign_partial(struct peer *p, int slow_only)
 {
-    assert(!p->n->endgame && peer_leech_ok(p));
     struct piece *pc;
     struct net *n = p->n;
     unsigned count = 0;
+    if (peer_laden(p) || n->endgame)
+        return 0;
     BTPDQ_FOREACH(pc, &n->getlst, entry) {
-        if (piece_full(pc) || !peer_requestable(p, pc->index))
+        if ((piece_full(pc) || !peer_requestable(p, pc->index)
+                || (slow_only && !pc->slow)))
             continue;
         count += dl_piece_assign_requests(pc, p);
         if (n->endgame)
@@ -502,18 +810,115 @@ dl_assign_requests(struct peer *p)
         if (peer_laden(p))
             break;
     }
-    while (!peer_laden(p) && !n->endgame) {
+    return count;
+}
+
+/*
+ * Start on new pieces, while there are fewer than max_partial of them.
+ */
+static unsigned
+dl_assign_new(struct peer *p, int slow, uint32_t max_partial)
+{
+    struct net *n = p->n;
+    unsigned count = 0;
+    while (!peer_laden(p) && !n->endgame && n->npcs_busy < max_partial) {
         uint32_t index;
         if (dl_choose_rarest(p, &index) == 0) {
-            pc = dl_new_piece(n, index);
-            if (pc != NULL)
-                count += dl_piece_assign_requests(pc, p);
+            struct piece *pc = dl_new_piece(n, index);
+            pc->slow = slow;
+            count += dl_piece_assign_requests(pc, p);
         } else
             break;
     }
     return count;
 }
 
+static uint32_t
+dl_stream_end(struct net *n)
+{
+    uint32_t window = STREAMWINDOW / n->tp->piece_length;
+    if (window < STREAMMINPIECES)
+        window = STREAMMINPIECES;
+    return min(n->tp->npieces, n->stream_head + window);
+}
+
+/*
+ * Put requests on the pieces in the stream window, in order. The
+ * pieces in the window are given a deadline of STREAMDEADLINE seconds
+ * each, counted from when the window last moved. Fast peers get on
+ * them at once while slow peers are only let on the pieces that are
+ * past their deadline.
+ */
+static unsigned
+dl_assign_stream(struct peer *p, int slow)
+{
+    struct net *n = p->n;
+    unsigned count = 0;
+    uint32_t end;
+
+    while ((n->stream_head < n->tp->npieces
+            && (cm_has_piece(n->tp, n->stream_head)
+                || has_bit(n->skip_field, n->stream_head)))) {
+        n->stream_head++;
+        n->stream_t = btpd_seconds;
+    }
+    end = dl_stream_end(n);
+    for (uint32_t i = n->stream_head; i < end; i++) {
+        struct piece *pc;
+        if (peer_laden(p) || n->endgame)
+            break;
+        if (slow && btpd_seconds <
+                n->stream_t + STREAMDEADLINE * (long)(i - n->stream_head + 1))
+            break;
+        if ((pc = dl_find_piece(n, i)) != NULL) {
+            if (piece_full(pc) || !peer_requestable(p, i))
+                continue;
+        } else if (dl_piece_startable(p, i)) {
+            pc = dl_new_piece(n, i);
+            pc->slow = slow;
+        } else
+            continue;
+        count += dl_piece_assign_requests(pc, p);
+    }
+    return count;
+}
+
+/*
+ * Request as many blocks as possible from the peer. Puts
+ * requests on already active pieces before starting on new
+ * ones. Care must be taken since end game mode may be triggered
+ * by the calls to dl_piece_assign_requests.
+ *
+ * New pieces are only started while the number of partial pieces is
+ * below dl_max_partial. A peer that gets nothing from the started
+ * pieces may start one more, so that it isn't left idle.
+ *
+ * Slow peers keep to the pieces started by other slow peers, so that
+ * they don't hold up the pieces the fast peers are working on. Only
+ * when that and starting new pieces doesn't fill their pipeline they
+ * are let onto the other pieces.
+ *
+ * In stream mode the pieces in the stream window go before all else.
+ *
+ * Returns number of requests sent.
+ */
+unsigned
+dl_assign_requests(struct peer *p)
+{
+    assert(!p->n->endgame && peer_leech_ok(p));
+    int slow = dl_peer_slow(p);
+    unsigned count = 0;
+    if (p->n->stream)
+        count += dl_assign_stream(p, slow);
+    count += dl_assign_partial(p, slow);
+    count += dl_assign_new(p, slow, dl_max_partial(p->n));
+    if (slow)
+        count += dl_assign_partial(p, 0);
+    if (p->nreqs_out == 0)
+        count += dl_assign_new(p, slow, p->n->npcs_busy + 1);
+    return count;
+}
+
 void
 dl_unassign_requests(struct peer *p)
 {
@@ -526,12 +931,10 @@ dl_unassign_requests(struct peer *p)
             struct block_request *next = BTPDQ_NEXT(req, p_entry);
 
             uint32_t blki = nb_get_begin(req->msg) / PIECE_BLOCKLEN;
-            // XXX: Needs to be looked at if we introduce snubbing.
             assert(has_bit(pc->down_field, blki));
             clear_bit(pc->down_field, blki);
             pc->nbusy--;
-            BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
-            p->nreqs_out--;
+            peer_req_remove(p, req);
             BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
             nb_drop(req->msg);
             free(req);
@@ -557,6 +960,7 @@ dl_piece_assign_requests_eg(struct piece *pc, struct peer *p)
     unsigned first_block = pc->next_block;
     do {
         if ((has_bit(pc->have_field, pc->next_block)
+                || pc->eg_nreqs[pc->next_block] >= MAXEGREQS
                 || peer_requested(p, pc->index, pc->next_block))) {
             INCNEXTBLOCK(pc);
             continue;
@@ -579,20 +983,23 @@ dl_assign_requests_eg(struct peer *p)
     struct piece_tq tmp;
     BTPDQ_INIT(&tmp);
 
-    struct piece *pc = BTPDQ_FIRST(&n->getlst);
-    while (!peer_laden(p) && pc != NULL) {
-        struct piece *next = BTPDQ_NEXT(pc, entry);
-        if (peer_requestable(p, pc->index) && pc->nblocks != pc->ngot) {
-            dl_piece_assign_requests_eg(pc, p);
-            BTPDQ_REMOVE(&n->getlst, pc, entry);
-            BTPDQ_INSERT_HEAD(&tmp, pc, entry);
+    // The last bucket only has blocks requested MAXEGREQS times.
+    for (int b = 0; b < MAXEGREQS && !peer_laden(p); b++) {
+        struct piece *pc = BTPDQ_FIRST(&n->eg_bkts[b]);
+        while (!peer_laden(p) && pc != NULL) {
+            struct piece *next = BTPDQ_NEXT(pc, eg_entry);
+            if (peer_requestable(p, pc->index)) {
+                dl_piece_assign_requests_eg(pc, p);
+                dl_piece_remove_eg(pc);
+                BTPDQ_INSERT_HEAD(&tmp, pc, eg_entry);
+            }
+            pc = next;
         }
-        pc = next;
     }
 
-    pc = BTPDQ_FIRST(&tmp);
+    struct piece *pc = BTPDQ_FIRST(&tmp);
     while (pc != NULL) {
-        struct piece *next = BTPDQ_NEXT(pc, entry);
+        struct piece *next = BTPDQ_NEXT(pc, eg_entry);
         dl_piece_insert_eg(pc);
         pc = next;
     }
@@ -603,20 +1010,16 @@ dl_unassign_requests_eg(struct peer *p)
 {
     struct block_request *req;
     struct piece *pc;
-    struct piece_tq tmp;
-    BTPDQ_INIT(&tmp);
 
     while (p->nreqs_out > 0) {
         req = BTPDQ_FIRST(&p->my_reqs);
 
         pc = dl_find_piece(p->n, nb_get_index(req->msg));
-        BTPDQ_REMOVE(&pc->n->getlst, pc, entry);
-        BTPDQ_INSERT_HEAD(&tmp, pc, entry);
 
         while (req != NULL) {
             struct block_request *next = BTPDQ_NEXT(req, p_entry);
-            BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
-            p->nreqs_out--;
+            pc->eg_nreqs[nb_get_begin(req->msg) / PIECE_BLOCKLEN]--;
+            peer_req_remove(p, req);
             BTPDQ_REMOVE(&pc->reqs, req, blk_entry);
             nb_drop(req->msg);
             free(req);
@@ -626,14 +1029,8 @@ dl_unassign_requests_eg(struct peer *p)
                 next = BTPDQ_NEXT(next, p_entry);
             req = next;
         }
+        dl_piece_reorder_eg(pc);
     }
     assert(BTPDQ_EMPTY(&p->my_reqs));
     peer_on_no_reqs(p);
-
-    pc = BTPDQ_FIRST(&tmp);
-    while (pc != NULL) {
-        struct piece *next = BTPDQ_NEXT(pc, entry);
-        dl_piece_insert_eg(pc);
-        pc = next;
-    }
 }
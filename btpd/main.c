@@ -123,6 +123,10 @@ usage(void)
         "--empty-start\n"
         "\tStart btpd without any active torrents.\n"
         "\n"
+        "--hash-threads n\n"
+        "\tCheck up to n downloaded pieces, or runs of the startup test,\n"
+        "\tat once. Default is 2.\n"
+        "\n"
         "--help\n"
         "\tShow this text.\n"
         "\n"
@@ -182,6 +186,7 @@ static struct option longopts[] = {
     { "ip", required_argument,          &longval,       10 },
     { "logmask", required_argument,     &longval,       11 },
     { "numwant", required_argument,     &longval,       12 },
+    { "hash-threads", required_argument, &longval,      13 },
     { "help",   no_argument,            &longval,       128 },
     { NULL,     0,                      NULL,           0 }
 };
@@ -246,6 +251,9 @@ main(int argc, char **argv)
             case 12:
                 net_numwant = (unsigned)atoi(optarg);
                 break;
+            case 13:
+                cm_hash_threads = max(1, atoi(optarg));
+                break;
             default:
                 usage();
             }
@@ -26,6 +26,9 @@ unsigned net_npeers;
 struct peer_tq net_bw_readq = BTPDQ_HEAD_INITIALIZER(net_bw_readq);
 struct peer_tq net_bw_writeq = BTPDQ_HEAD_INITIALIZER(net_bw_writeq);
 struct peer_tq net_unattached = BTPDQ_HEAD_INITIALIZER(net_unattached);
+struct peer_tq net_flushq = BTPDQ_HEAD_INITIALIZER(net_flushq);
+
+static struct timeout m_flush_to;
 
 void
 net_ban_peer(struct net *n, struct meta_peer *mp)
@@ -43,6 +46,18 @@ net_torrent_has_peer(struct net *n, const uint8_t *id)
     return mptbl_find(n->mptbl, id) != NULL;
 }
 
+static int
+piece_index_eq(const void *k1, const void *k2)
+{
+    return *(const uint32_t *)k1 == *(const uint32_t *)k2;
+}
+
+static uint32_t
+piece_index_hash(const void *k)
+{
+    return *(const uint32_t *)k;
+}
+
 void
 net_create(struct torrent *tp)
 {
@@ -54,9 +69,26 @@ net_create(struct torrent *tp)
         btpd_err("Out of memory.\n");
 
     BTPDQ_INIT(&n->getlst);
+    for (int i = 0; i <= MAXEGREQS; i++)
+        BTPDQ_INIT(&n->eg_bkts[i]);
+    if ((n->pctbl = pctbl_create(1, piece_index_eq, piece_index_hash)) == NULL)
+        btpd_err("Out of memory.\n");
 
     n->busy_field = btpd_calloc(ceil(tp->npieces / 8.0), 1);
+    n->skip_field = btpd_calloc(ceil(tp->npieces / 8.0), 1);
     n->piece_count = btpd_calloc(tp->npieces, sizeof(*n->piece_count));
+
+    n->rare_pos = btpd_malloc(tp->npieces * sizeof(*n->rare_pos));
+    for (uint32_t i = 0; i < tp->npieces; i++)
+        n->rare_pos[i] = RARE_NONE;
+    n->rare_high = btpd_calloc(ceil(tp->npieces / 8.0), 1);
+    for (int h = 0; h < 2; h++) {
+        struct rare_index *ri = &n->rare[h];
+        ri->pcs = btpd_malloc(tp->npieces * sizeof(*ri->pcs));
+        ri->n = 0;
+        ri->cap = 8;
+        ri->start = btpd_calloc(ri->cap, sizeof(*ri->start));
+    }
 }
 
 void
@@ -70,8 +102,16 @@ net_kill(struct torrent *tp)
         mp_kill(mps);
     }
     mptbl_free(tp->net->mptbl);
+    pctbl_free(tp->net->pctbl);
     free(tp->net->piece_count);
+    for (int h = 0; h < 2; h++) {
+        free(tp->net->rare[h].pcs);
+        free(tp->net->rare[h].start);
+    }
+    free(tp->net->rare_pos);
+    free(tp->net->rare_high);
     free(tp->net->busy_field);
+    free(tp->net->skip_field);
     free(tp->net);
     tp->net = NULL;
 }
@@ -81,6 +121,7 @@ net_start(struct torrent *tp)
 {
     struct net *n = tp->net;
     n->active = 1;
+    dl_on_prio_change(n);
 }
 
 void
@@ -122,6 +163,202 @@ net_active(struct torrent *tp)
 }
 
 #define BLOCK_MEM_COUNT 1
+#define BLOCK_PREFETCH_COUNT 8
+#define BLOCK_READAHEAD_COUNT 2
+
+/*
+ * Cleared for good if the system can't send file data directly to
+ * sockets. Torrent data is then read into memory before it's sent.
+ * Otherwise a disk worker only brings it into the page cache, and it's
+ * sent from the file once it's there.
+ */
+static int m_zerocopy = 1;
+
+struct net_fill {
+    struct net_buf *nb;
+    struct meta_peer *mp;
+    struct net *n;
+};
+
+static void
+net_fill_cb(void *arg, int err, uint8_t *content)
+{
+    struct net_fill *f = arg;
+    struct peer *p = f->mp->p;
+
+    f->nb->flags &= ~NBF_READING;
+    if (err == 0 && content == NULL)
+        f->nb->flags |= NBF_WARM;
+    else if (err == 0)
+        nb_torrentdata_fill(f->nb, content);
+    if (p != NULL && err != 0)
+        peer_kill(p);
+    else if (p != NULL && !BTPDQ_EMPTY(&p->outq)
+            && (p->mp->flags & PF_ON_WRITEQ) == 0)
+        btpd_ev_enable(&p->ioev, EV_WRITE);
+    nb_drop(f->nb);
+    mp_drop(f->mp, f->n);
+    free(f);
+}
+
+/*
+ * Have the data of a piece message read by a disk worker, into memory
+ * or only into the page cache if it's to be sent from the file. The
+ * peer is woken up for writing when it's there.
+ */
+static int
+net_fill(struct peer *p, struct net_buf *nb)
+{
+    int err;
+    struct net_fill *f;
+
+    if (nb->flags & NBF_READING)
+        return 0;
+    f = btpd_malloc(sizeof(*f));
+    f->nb = nb;
+    f->mp = p->mp;
+    f->n = p->n;
+    if (m_zerocopy && (nb->flags & NBF_WARM) == 0)
+        err = cm_warm_bytes(p->n->tp, nb->index, nb->begin, nb->len,
+            net_fill_cb, f);
+    else
+        err = cm_fetch_bytes(p->n->tp, nb->index, nb->begin, nb->len,
+            net_fill_cb, f);
+    if (err != 0) {
+        free(f);
+        return err;
+    }
+    nb_hold(nb);
+    mp_hold(p->mp);
+    nb->flags |= NBF_READING;
+    return 0;
+}
+
+/*
+ * Wait for the data first in the peer's outq to be read.
+ */
+static unsigned long
+net_write_wait(struct peer *p, struct net_buf *nb)
+{
+    if (net_fill(p, nb) != 0)
+        peer_kill(p);
+    else
+        btpd_ev_disable(&p->ioev, EV_WRITE);
+    return 0;
+}
+
+/*
+ * Get the data of the next few piece messages in the peer's outq on
+ * its way, so it's there by the time the socket can take it. The next
+ * couple of blocks are read by the disk workers, if they keep up. The
+ * rest of the data that's sent from the file is only hinted to be
+ * brought into memory, which costs no memory of our own.
+ */
+static void
+net_prefetch(struct peer *p)
+{
+    struct nb_link *nl;
+    int block_count = 0;
+    BTPDQ_FOREACH(nl, &p->outq, entry) {
+        struct net_buf *nb = nl->nb;
+        if (nb->type != NB_TORRENTDATA)
+            continue;
+        if (block_count >= BLOCK_PREFETCH_COUNT)
+            break;
+        block_count++;
+        if (nb->buf != NULL || (nb->flags & (NBF_READING|NBF_WARM)) != 0)
+            continue;
+        if (block_count <= BLOCK_READAHEAD_COUNT && !dio_congested()) {
+            if (net_fill(p, nb) != 0)
+                break;
+        } else if (!m_zerocopy)
+            break;
+        else if ((nb->flags & NBF_PREFETCHED) == 0) {
+            cm_prefetch(p->n->tp, nb->index, nb->begin, nb->len);
+            nb->flags |= NBF_PREFETCHED;
+        }
+    }
+}
+
+static void
+net_write_done(struct peer *p, unsigned long bcount)
+{
+    struct nb_link *nl = BTPDQ_FIRST(&p->outq);
+    while (bcount > 0) {
+        unsigned long bufdelta = nl->nb->len - p->outq_off;
+        if (bcount >= bufdelta) {
+            peer_sent(p, nl->nb);
+            if (nl->nb->type == NB_TORRENTDATA) {
+                p->n->uploaded += bufdelta;
+                p->count_up += bufdelta;
+            }
+            bcount -= bufdelta;
+            peer_outq_remove(p, nl);
+            nb_drop(nl->nb);
+            nb_link_free(nl);
+            p->outq_off = 0;
+            nl = BTPDQ_FIRST(&p->outq);
+        } else {
+            if (nl->nb->type == NB_TORRENTDATA) {
+                p->n->uploaded += bcount;
+                p->count_up += bcount;
+            }
+            p->outq_off +=  bcount;
+            bcount = 0;
+        }
+    }
+    if (!BTPDQ_EMPTY(&p->outq)) {
+        p->t_wantwrite = btpd_seconds;
+        net_prefetch(p);
+    } else
+        btpd_ev_disable(&p->ioev, EV_WRITE);
+    p->t_lastwrite = btpd_seconds;
+}
+
+/*
+ * Send the torrent data first in the peer's outq straight from the
+ * content file, once a disk worker has brought it into the page cache
+ * so the event loop doesn't wait for the disk. If that fails for any
+ * reason but a full socket buffer the data is read into memory, so that
+ * the next write uses writev and gives any error a proper treatment.
+ */
+static unsigned long
+net_write_file(struct peer *p, unsigned long wmax)
+{
+    struct net_buf *nb = BTPDQ_FIRST(&p->outq)->nb;
+    size_t len = nb->len - p->outq_off;
+    size_t sent;
+    int err;
+
+    if (wmax > 0 && len > wmax)
+        len = wmax;
+    err = cm_send_bytes(p->n->tp, nb->index, nb->begin + p->outq_off, len,
+        p->sd, &sent);
+    if (err == EAGAIN) {
+        btpd_ev_again(&p->ioev, EV_WRITE);
+        p->t_wantwrite = btpd_seconds;
+        return 0;
+    } else if (err != 0) {
+        if (err == EINVAL || err == ENOSYS) {
+            btpd_log(BTPD_L_ERROR, "can't send data from file (%s).\n",
+                strerror(err));
+            m_zerocopy = 0;
+        }
+        return net_write_wait(p, nb);
+    }
+    net_write_done(p, sent);
+    return sent;
+}
+
+/*
+ * Runs of small messages, such as requests and haves, are copied
+ * together into m_pack and written from there, instead of taking an
+ * iovec each. The queue itself keeps one link per message, so they
+ * can still be unsent until they're actually written.
+ */
+#define NET_PACK_MSGLEN 17
+
+static char m_pack[1 << 12];
 
 static unsigned long
 net_write(struct peer *p, unsigned long wmax)
@@ -131,49 +368,78 @@ net_write(struct peer *p, unsigned long wmax)
     int niov;
     int limited;
     ssize_t nwritten;
-    unsigned long bcount;
     int block_count = 0;
+    int from_file = 0;
+    int reading = 0;
+    int packiov = -1;
+    size_t packlen = 0;
 
     limited = wmax > 0;
 
     niov = 0;
     assert((nl = BTPDQ_FIRST(&p->outq)) != NULL);
-    if (nl->nb->type == NB_TORRENTDATA)
+    if (nl->nb->type == NB_TORRENTDATA) {
+        if (nl->nb->buf == NULL) {
+            if (m_zerocopy && (nl->nb->flags & NBF_WARM) != 0)
+                return net_write_file(p, wmax);
+            return net_write_wait(p, nl->nb);
+        }
         block_count = 1;
+    }
     while ((niov < IOV_MAX && nl != NULL
                && (!limited || (limited && wmax > 0)))) {
         if (nl->nb->type == NB_PIECE) {
             if (block_count >= BLOCK_MEM_COUNT)
                 break;
             struct net_buf *tdata = BTPDQ_NEXT(nl, entry)->nb;
-            if (tdata->buf == NULL) {
-                if (nb_torrentdata_fill(tdata, p->n->tp, nb_get_index(nl->nb),
-                        nb_get_begin(nl->nb), nb_get_length(nl->nb)) != 0) {
+            if (m_zerocopy && (tdata->flags & NBF_WARM) != 0
+                    && tdata->buf == NULL)
+                from_file = 1;
+            else if (tdata->buf == NULL) {
+                if (net_fill(p, tdata) != 0) {
                     peer_kill(p);
                     return 0;
                 }
+                reading = 1;
             }
             block_count++;
         }
-        if (niov > 0) {
-            iov[niov].iov_base = nl->nb->buf;
-            iov[niov].iov_len = nl->nb->len;
-        } else {
-            iov[niov].iov_base = nl->nb->buf + p->outq_off;
-            iov[niov].iov_len = nl->nb->len - p->outq_off;
+        char *base = nl->nb->buf;
+        size_t len = nl->nb->len;
+        if (nl == BTPDQ_FIRST(&p->outq)) {
+            base += p->outq_off;
+            len -= p->outq_off;
         }
         if (limited) {
-            if (iov[niov].iov_len > wmax)
-                iov[niov].iov_len = wmax;
-            wmax -= iov[niov].iov_len;
+            if (len > wmax)
+                len = wmax;
+            wmax -= len;
+        }
+        if (len <= NET_PACK_MSGLEN && packlen + len <= sizeof(m_pack)) {
+            bcopy(base, m_pack + packlen, len);
+            if (packiov >= 0 && packiov == niov - 1)
+                iov[packiov].iov_len += len;
+            else {
+                packiov = niov;
+                iov[niov].iov_base = m_pack + packlen;
+                iov[niov].iov_len = len;
+                niov++;
+            }
+            packlen += len;
+        } else {
+            iov[niov].iov_base = base;
+            iov[niov].iov_len = len;
+            niov++;
         }
-        niov++;
         nl = BTPDQ_NEXT(nl, entry);
+        if (from_file || reading)
+            break;
     }
 
     nwritten = writev(p->sd, iov, niov);
     if (nwritten < 0) {
         if (errno == EAGAIN) {
+            btpd_ev_again(&p->ioev, EV_WRITE);
             p->t_wantwrite = btpd_seconds;
             return 0;
         } else {
@@ -187,38 +453,13 @@ net_write(struct peer *p, unsigned long wmax)
         return 0;
     }
 
-    bcount = nwritten;
+    net_write_done(p, nwritten);
 
-    nl = BTPDQ_FIRST(&p->outq);
-    while (bcount > 0) {
-        unsigned long bufdelta = nl->nb->len - p->outq_off;
-        if (bcount >= bufdelta) {
-            peer_sent(p, nl->nb);
-            if (nl->nb->type == NB_TORRENTDATA) {
-                p->n->uploaded += bufdelta;
-                p->count_up += bufdelta;
-            }
-            bcount -= bufdelta;
-            BTPDQ_REMOVE(&p->outq, nl, entry);
-            nb_drop(nl->nb);
-            free(nl);
-            p->outq_off = 0;
-            nl = BTPDQ_FIRST(&p->outq);
-        } else {
-            if (nl->nb->type == NB_TORRENTDATA) {
-                p->n->uploaded += bcount;
-                p->count_up += bcount;
-            }
-            p->outq_off +=  bcount;
-            bcount = 0;
-        }
-    }
-    if (!BTPDQ_EMPTY(&p->outq))
-        p->t_wantwrite = btpd_seconds;
-    else
+    if (from_file && BTPDQ_FIRST(&p->outq) == nl && p->outq_off == 0
+            && (!limited || wmax > 0))
+        nwritten += net_write_file(p, wmax);
+    else if (reading && BTPDQ_FIRST(&p->outq) == nl && nl->nb->buf == NULL)
         btpd_ev_disable(&p->ioev, EV_WRITE);
-    p->t_lastwrite = btpd_seconds;
-
     return nwritten;
 }
 
@@ -274,8 +515,9 @@ net_dispatch_msg(struct peer *p, const char *buf)
         peer_on_cancel(p, index, begin, length);
         break;
     case MSG_PIECE:
+        // Only empty blocks come this way, see BTP_PIECEMETA.
         length = p->in.msg_len - 9;
-        peer_on_piece(p, p->in.pc_index, p->in.pc_begin, length, buf);
+        peer_on_piece(p, p->in.pc_index, p->in.pc_begin, length, NULL);
         break;
     default:
         abort();
@@ -310,7 +552,8 @@ net_mh_ok(struct peer *p)
 static void
 net_progress(struct peer *p, size_t length)
 {
-    if (p->in.state == BTP_MSGBODY && p->in.msg_num == MSG_PIECE) {
+    if ((p->in.state == BTP_MSGBODY && p->in.msg_num == MSG_PIECE)
+            || p->in.state == BTP_PIECEBODY || p->in.state == BTP_PIECESKIP) {
         p->n->downloaded += length;
         p->count_dwn += length;
     }
@@ -367,7 +610,13 @@ net_state(struct peer *p, const char *buf)
     case BTP_PIECEMETA:
         p->in.pc_index = dec_be32(buf);
         p->in.pc_begin = dec_be32(buf + 4);
-        peer_set_in_state(p, BTP_MSGBODY, p->in.msg_len - 9);
+        if (p->in.msg_len > 9 && peer_expects_block(p, p->in.pc_index,
+                p->in.pc_begin, p->in.msg_len - 9))
+            peer_set_in_state(p, BTP_PIECEBODY, p->in.msg_len - 9);
+        else if (p->in.msg_len > 9)
+            peer_set_in_state(p, BTP_PIECESKIP, p->in.msg_len - 9);
+        else
+            peer_set_in_state(p, BTP_MSGBODY, p->in.msg_len - 9);
         break;
     case BTP_MSGBODY:
         if (net_dispatch_msg(p, buf) != 0)
@@ -386,10 +635,86 @@ bad:
     return -1;
 }
 
+/*
+ * A block we asked for is received into an input buffer like any
+ * other message, which is then handed on to be written by a disk
+ * worker. Once a block is split across reads the rest of it is read
+ * straight into its buffer.
+ */
+static void
+net_piece_body(struct peer *p, char *data)
+{
+    peer_on_piece(p, p->in.pc_index, p->in.pc_begin, p->in.msg_len - 9,
+        (uint8_t *)data);
+    peer_set_in_state(p, BTP_MSGSIZE, 4);
+}
+
+/*
+ * Blocks we didn't ask for are dropped as they arrive, without taking
+ * a buffer.
+ */
+static void
+net_piece_skip(struct peer *p, size_t len)
+{
+    p->in.st_bytes -= len;
+    if (p->in.st_bytes > 0)
+        return;
+    peer_on_piece_discard(p, p->in.pc_index, p->in.pc_begin,
+        p->in.msg_len - 9);
+    peer_set_in_state(p, BTP_MSGSIZE, 4);
+}
+
+/*
+ * Messages that don't arrive whole, and received blocks, are kept in
+ * buffers of NET_INBUF_LEN bytes, which is enough for anything but big
+ * bitfields. Blocks come back here once they're written. Up to
+ * NET_INBUF_CACHE of them are kept for reuse, so a peer sending a
+ * steady stream doesn't cost an allocation per message.
+ */
+#define NET_INBUF_LEN PIECE_BLOCKLEN
+#define NET_INBUF_CACHE 256
+
+struct net_inbuf {
+    struct net_inbuf *next;
+};
+
+static struct net_inbuf *m_inbufs;
+static unsigned m_ninbufs;
+
+static char *
+net_inbuf_get(size_t len)
+{
+    struct net_inbuf *ib = m_inbufs;
+    if (len > NET_INBUF_LEN)
+        return btpd_malloc(len);
+    else if (ib == NULL)
+        return btpd_malloc(NET_INBUF_LEN);
+    m_inbufs = ib->next;
+    m_ninbufs--;
+    return (char *)ib;
+}
+
+void
+net_inbuf_put(char *buf, size_t len)
+{
+    struct net_inbuf *ib = (struct net_inbuf *)buf;
+    if (len > NET_INBUF_LEN || m_ninbufs == NET_INBUF_CACHE)
+        free(buf);
+    else {
+        ib->next = m_inbufs;
+        m_inbufs = ib;
+        m_ninbufs++;
+    }
+}
+
 #define GRBUFLEN (1 << 15)
 
-static unsigned long
-net_read(struct peer *p, unsigned long rmax)
+/*
+ * Returns the number of bytes read, or -1 if the peer has been killed.
+ * *full is set when the read filled the buffers, so there may be more.
+ */
+static ssize_t
+net_read_some(struct peer *p, unsigned long rmax, int *full)
 {
     size_t rest = p->in.buf != NULL ? p->in.st_bytes - p->in.off : 0;
     char buf[GRBUFLEN];
@@ -409,18 +734,23 @@ net_read(struct peer *p, unsigned long rmax)
         iov[1].iov_len = min(rmax - iov[0].iov_len, iov[1].iov_len);
     }
 
+    *full = 0;
+    size_t want = iov[0].iov_len + iov[1].iov_len;
     ssize_t nread = readv(p->sd, iov, 2);
-    if (nread < 0 && errno == EAGAIN)
+    if (nread < 0 && errno == EAGAIN) {
+        btpd_ev_again(&p->ioev, EV_READ);
         goto out;
+    }
     else if (nread < 0) {
         btpd_log(BTPD_L_CONN, "Read error (%s) on %p.\n", strerror(errno), p);
         peer_kill(p);
-        return 0;
+        return -1;
     } else if (nread == 0) {
         btpd_log(BTPD_L_CONN, "Connection closed by %p.\n", p);
         peer_kill(p);
-        return 0;
+        return -1;
     }
+    *full = nread == want;
 
     if (rest > 0) {
         if (nread < rest) {
@@ -429,19 +759,34 @@ net_read(struct peer *p, unsigned long rmax)
             goto out;
         }
         net_progress(p, rest);
-        if (net_state(p, p->in.buf) != 0)
-            return nread;
-        free(p->in.buf);
-        p->in.buf = NULL;
-        p->in.off = 0;
+        char *ibuf = p->in.buf;
+        size_t ilen = p->in.st_bytes;
+        if (p->in.state == BTP_PIECEBODY) {
+            p->in.buf = NULL;
+            p->in.off = 0;
+            net_piece_body(p, ibuf);
+        } else {
+            if (net_state(p, ibuf) != 0)
+                return -1;
+            net_inbuf_put(ibuf, ilen);
+            p->in.buf = NULL;
+            p->in.off = 0;
+        }
     }
 
     iov[1].iov_len = nread - rest;
-    while (p->in.st_bytes <= iov[1].iov_len) {
-        size_t consumed = p->in.st_bytes;
+    while (p->in.st_bytes <= iov[1].iov_len
+            || (p->in.state == BTP_PIECESKIP && iov[1].iov_len > 0)) {
+        size_t consumed = min(p->in.st_bytes, iov[1].iov_len);
         net_progress(p, consumed);
-        if (net_state(p, iov[1].iov_base) != 0)
-            return nread;
+        if (p->in.state == BTP_PIECESKIP)
+            net_piece_skip(p, consumed);
+        else if (p->in.state == BTP_PIECEBODY) {
+            char *data = net_inbuf_get(consumed);
+            bcopy(iov[1].iov_base, data, consumed);
+            net_piece_body(p, data);
+        } else if (net_state(p, iov[1].iov_base) != 0)
+            return -1;
         iov[1].iov_base += consumed;
         iov[1].iov_len -= consumed;
     }
@@ -449,7 +794,7 @@ net_read(struct peer *p, unsigned long rmax)
     if (iov[1].iov_len > 0) {
         net_progress(p, iov[1].iov_len);
         p->in.off = iov[1].iov_len;
-        p->in.buf = btpd_malloc(p->in.st_bytes);
+        p->in.buf = net_inbuf_get(p->in.st_bytes);
         bcopy(iov[1].iov_base, p->in.buf, iov[1].iov_len);
     }
 
@@ -457,6 +802,26 @@ out:
     return nread > 0 ? nread : 0;
 }
 
+/*
+ * Keep reading while the reads fill the buffers, up to NET_READ_BUDGET
+ * bytes, so a busy peer is served in one go without starving others.
+ */
+#define NET_READ_BUDGET (1 << 17)
+
+static unsigned long
+net_read(struct peer *p, unsigned long rmax)
+{
+    unsigned long count = 0;
+    ssize_t nread;
+    int full;
+    do {
+        if ((nread = net_read_some(p, rmax > 0 ? rmax - count : 0, &full)) < 0)
+            break;
+        count += nread;
+    } while (full && count < NET_READ_BUDGET && (rmax == 0 || count < rmax));
+    return count;
+}
+
 int
 net_connect_addr(int family, struct sockaddr *sa, socklen_t salen, int *sd)
 {
@@ -544,6 +909,9 @@ compute_rates(void) {
         unsigned long tp_up = 0, tp_dwn = 0;
         struct net *n = tp->net;
         struct peer *p;
+        uint32_t nblocks = torrent_piece_blocks(tp, 0);
+        n->npeers_dwn = 0;
+        n->npcs_pipe = 0;
         BTPDQ_FOREACH(p, &n->peers, p_entry) {
             if (p->count_up > 0 || peer_active_up(p)) {
                 tp_up += p->count_up;
@@ -554,6 +922,8 @@ compute_rates(void) {
                 tp_dwn += p->count_dwn;
                 p->rate_dwn += p->count_dwn - compute_rate_sub(p->rate_dwn);
                 p->count_dwn = 0;
+                n->npeers_dwn++;
+                n->npcs_pipe += (p->nreqs_max + nblocks - 1) / nblocks;
             }
         }
         n->rate_up += tp_up - compute_rate_sub(n->rate_up);
@@ -565,6 +935,32 @@ compute_rates(void) {
     m_rate_dwn += tot_dwn - compute_rate_sub(m_rate_dwn);
 }
 
+/*
+ * Let the peers waiting to read do so, as long as there's bandwidth
+ * for it and the disk workers keep up.
+ */
+static void
+net_bw_readq_run(void)
+{
+    struct peer *p;
+    while ((p = BTPDQ_FIRST(&net_bw_readq)) != NULL && !dio_congested()
+            && (net_bw_limit_in == 0 || m_bw_bytes_in > 0)) {
+        BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
+        btpd_ev_enable(&p->ioev, EV_READ);
+        p->mp->flags &= ~PF_ON_READQ;
+        if (net_bw_limit_in == 0)
+            net_read(p, 0);
+        else
+            m_bw_bytes_in -= net_read(p, m_bw_bytes_in);
+    }
+}
+
+void
+net_on_dio_drain(void)
+{
+    net_bw_readq_run();
+}
+
 static void
 net_bw_tick(void)
 {
@@ -573,21 +969,7 @@ net_bw_tick(void)
     m_bw_bytes_out = net_bw_limit_out;
     m_bw_bytes_in = net_bw_limit_in;
 
-    if (net_bw_limit_in > 0) {
-        while ((p = BTPDQ_FIRST(&net_bw_readq)) != NULL && m_bw_bytes_in > 0) {
-            BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
-            btpd_ev_enable(&p->ioev, EV_READ);
-            p->mp->flags &= ~PF_ON_READQ;
-            m_bw_bytes_in -= net_read(p, m_bw_bytes_in);
-        }
-    } else {
-        while ((p = BTPDQ_FIRST(&net_bw_readq)) != NULL) {
-            BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
-            btpd_ev_enable(&p->ioev, EV_READ);
-            p->mp->flags &= ~PF_ON_READQ;
-            net_read(p, 0);
-        }
-    }
+    net_bw_readq_run();
 
     if (net_bw_limit_out) {
         while (((p = BTPDQ_FIRST(&net_bw_writeq)) != NULL
@@ -629,12 +1011,16 @@ net_on_tick(void)
     net_bw_tick();
 }
 
+/*
+ * Peers are also kept from reading while the disk workers are behind,
+ * which holds back the blocks they'd otherwise deliver.
+ */
 static void
 net_read_cb(struct peer *p)
 {
-    if (net_bw_limit_in == 0)
+    if (net_bw_limit_in == 0 && !dio_congested())
         net_read(p, 0);
-    else if (m_bw_bytes_in > 0)
+    else if (m_bw_bytes_in > 0 && !dio_congested())
         m_bw_bytes_in -= net_read(p, m_bw_bytes_in);
     else {
         btpd_ev_disable(&p->ioev, EV_READ);
@@ -657,6 +1043,40 @@ net_write_cb(struct peer *p)
     }
 }
 
+/*
+ * Peers that got something to send while their outq was empty are
+ * written to before the event loop polls again, instead of after a
+ * round trip through it. Waiting until then lets the messages queued
+ * while handling the current event go out together, and keeps
+ * peer_send from killing peers under its callers.
+ */
+static void
+net_flush_cb(int sd, short type, void *arg)
+{
+    struct peer *p;
+    while ((p = BTPDQ_FIRST(&net_flushq)) != NULL) {
+        BTPDQ_REMOVE(&net_flushq, p, fq_entry);
+        p->mp->flags &= ~PF_ON_FLUSHQ;
+        if (BTPDQ_EMPTY(&p->outq) || (p->mp->flags & PF_ON_WRITEQ))
+            continue;
+        if (net_bw_limit_out == 0)
+            net_write(p, 0);
+        else if (m_bw_bytes_out > 0)
+            m_bw_bytes_out -= net_write(p, m_bw_bytes_out);
+    }
+}
+
+void
+net_write_soon(struct peer *p)
+{
+    if (p->mp->flags & PF_ON_FLUSHQ)
+        return;
+    if (BTPDQ_EMPTY(&net_flushq))
+        btpd_timer_add(&m_flush_to, (& (struct timespec) { 0, 0 }));
+    p->mp->flags |= PF_ON_FLUSHQ;
+    BTPDQ_INSERT_TAIL(&net_flushq, p, fq_entry);
+}
+
 void
 net_io_cb(int sd, short type, void *arg)
 {
@@ -698,6 +1118,8 @@ net_init(void)
     m_bw_bytes_out = net_bw_limit_out;
     m_bw_bytes_in = net_bw_limit_in;
 
+    evtimer_init(&m_flush_to, net_flush_cb, NULL);
+
     int safe_fds = getdtablesize() * 4 / 5;
     if (net_max_peers == 0 || net_max_peers > safe_fds)
         net_max_peers = safe_fds;
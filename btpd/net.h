@@ -16,11 +16,13 @@
 extern struct peer_tq net_unattached;
 extern struct peer_tq net_bw_readq;
 extern struct peer_tq net_bw_writeq;
+extern struct peer_tq net_flushq;
 extern unsigned net_npeers;
 
 void net_init(void);
 
 void net_on_tick(void);
+void net_on_dio_drain(void);
 
 void net_create(struct torrent *tp);
 void net_kill(struct torrent *tp);
@@ -33,6 +35,9 @@ void net_ban_peer(struct net *n, struct meta_peer *mp);
 int net_torrent_has_peer(struct net *n, const uint8_t *id);
 
 void net_io_cb(int sd, short type, void *arg);
+void net_write_soon(struct peer *p);
+
+void net_inbuf_put(char *buf, size_t len);
 
 int net_connect_addr(int family, struct sockaddr *sa, socklen_t salen,
     int *sd);
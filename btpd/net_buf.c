@@ -6,6 +6,46 @@ static struct net_buf *m_interest;
 static struct net_buf *m_uninterest;
 static struct net_buf *m_keepalive;
 
+/*
+ * Buffers for the small messages and the links that queue buffers on
+ * peers make up most allocations while requests and haves are flowing.
+ * Up to NB_CACHE of each are kept for reuse when released.
+ */
+#define NB_SMALL 17
+#define NB_CACHE 1024
+
+struct nb_free {
+    struct nb_free *next;
+};
+
+static struct nb_free *m_free_nbs, *m_free_links;
+static unsigned m_nfree_nbs, m_nfree_links;
+
+static void *
+nb_cache_get(struct nb_free **list, unsigned *count, size_t size)
+{
+    struct nb_free *f = *list;
+    if (f == NULL)
+        return btpd_calloc(1, size);
+    *list = f->next;
+    (*count)--;
+    bzero(f, size);
+    return f;
+}
+
+static void
+nb_cache_put(struct nb_free **list, unsigned *count, void *obj)
+{
+    struct nb_free *f = obj;
+    if (*count == NB_CACHE)
+        free(obj);
+    else {
+        f->next = *list;
+        *list = f;
+        (*count)++;
+    }
+}
+
 static void
 kill_buf_no(char *buf, size_t len)
 {
@@ -26,7 +66,12 @@ kill_buf_abort(char *buf, size_t len)
 static struct net_buf *
 nb_create_alloc(short type, size_t len)
 {
-    struct net_buf *nb = btpd_calloc(1, sizeof(*nb) + len);
+    struct net_buf *nb;
+    if (len <= NB_SMALL) {
+        nb = nb_cache_get(&m_free_nbs, &m_nfree_nbs, sizeof(*nb) + NB_SMALL);
+        nb->flags = NBF_SMALL;
+    } else
+        nb = btpd_calloc(1, sizeof(*nb) + len);
     nb->type = type;
     nb->buf = (char *)(nb + 1);
     nb->len = len;
@@ -86,27 +131,29 @@ nb_create_piece(uint32_t index, uint32_t begin, size_t blen)
     return out;
 }
 
+/*
+ * The data isn't read until it's about to be sent, either by
+ * cm_fetch_bytes or directly from the file with cm_send_bytes.
+ */
 struct net_buf *
-nb_create_torrentdata(void)
+nb_create_torrentdata(uint32_t index, uint32_t begin, size_t len)
 {
     struct net_buf *out;
-    out = nb_create_set(NB_TORRENTDATA, NULL, 0, kill_buf_no);
+    out = nb_create_set(NB_TORRENTDATA, NULL, len, kill_buf_no);
+    out->index = index;
+    out->begin = begin;
     return out;
 }
 
-int
-nb_torrentdata_fill(struct net_buf *nb, struct torrent *tp, uint32_t index,
-    uint32_t begin, uint32_t length)
+/*
+ * Give torrent data its content, once it's been read.
+ */
+void
+nb_torrentdata_fill(struct net_buf *nb, uint8_t *content)
 {
-    int err;
-    uint8_t *content;
     assert(nb->type == NB_TORRENTDATA && nb->buf == NULL);
-    if ((err = cm_get_bytes(tp, index, begin, length, &content)) != 0)
-        return err;
     nb->buf = content;
-    nb->len = length;
     nb->kill_buf = kill_buf_free;
-    return 0;
 }
 
 struct net_buf *
@@ -264,6 +311,24 @@ nb_get_length(struct net_buf *nb)
     }
 }
 
+/*
+ * Bulk messages are the ones that belong to our uploading. The rest
+ * are control messages, which are sent ahead of any bulk data.
+ */
+int
+nb_is_bulk(struct net_buf *nb)
+{
+    switch (nb->type) {
+    case NB_PIECE:
+    case NB_TORRENTDATA:
+    case NB_CHOKE:
+    case NB_UNCHOKE:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
 int
 nb_drop(struct net_buf *nb)
 {
@@ -271,7 +336,10 @@ nb_drop(struct net_buf *nb)
     nb->refs--;
     if (nb->refs == 0) {
         nb->kill_buf(nb->buf, nb->len);
-        free(nb);
+        if (nb->flags & NBF_SMALL)
+            nb_cache_put(&m_free_nbs, &m_nfree_nbs, nb);
+        else
+            free(nb);
         return 1;
     } else
         return 0;
@@ -282,3 +350,18 @@ nb_hold(struct net_buf *nb)
 {
     nb->refs++;
 }
+
+struct nb_link *
+nb_link_create(struct net_buf *nb)
+{
+    struct nb_link *nl =
+        nb_cache_get(&m_free_links, &m_nfree_links, sizeof(*nl));
+    nl->nb = nb;
+    return nl;
+}
+
+void
+nb_link_free(struct nb_link *nl)
+{
+    nb_cache_put(&m_free_links, &m_nfree_links, nl);
+}
@@ -16,17 +16,26 @@
 #define NB_SHAKE        13
 #define NB_KEEPALIVE    14
 
+#define NBF_PREFETCHED  1
+#define NBF_SMALL       2
+#define NBF_READING     4
+#define NBF_WARM        8
+
 struct net_buf {
     short type;
+    short flags;
     unsigned refs;
     char *buf;
     size_t len;
+    uint32_t index, begin;
     void (*kill_buf)(char *, size_t);
 };
 
 struct nb_link {
     struct net_buf *nb;
     BTPDQ_ENTRY(nb_link) entry;
+    uint64_t key;
+    HTBL_ENTRY(chain);
 };
 
 BTPDQ_HEAD(nb_tq, nb_link);
@@ -36,7 +45,8 @@ struct peer;
 
 struct net_buf *nb_create_keepalive(void);
 struct net_buf *nb_create_piece(uint32_t index, uint32_t begin, size_t blen);
-struct net_buf *nb_create_torrentdata(void);
+struct net_buf *nb_create_torrentdata(uint32_t index, uint32_t begin,
+    size_t len);
 struct net_buf *nb_create_request(uint32_t index,
     uint32_t begin, uint32_t length);
 struct net_buf *nb_create_cancel(uint32_t index,
@@ -51,12 +61,16 @@ struct net_buf *nb_create_bitfield(struct torrent *tp);
 struct net_buf *nb_create_bitdata(struct torrent *tp);
 struct net_buf *nb_create_shake(struct torrent *tp);
 
-int nb_torrentdata_fill(struct net_buf *nb, struct torrent *tp, uint32_t index,
-    uint32_t begin, uint32_t length);
+void nb_torrentdata_fill(struct net_buf *nb, uint8_t *content);
+
+int nb_is_bulk(struct net_buf *nb);
 
 int nb_drop(struct net_buf *nb);
 void nb_hold(struct net_buf *nb);
 
+struct nb_link *nb_link_create(struct net_buf *nb);
+void nb_link_free(struct nb_link *nl);
+
 uint32_t nb_get_index(struct net_buf *nb);
 uint32_t nb_get_begin(struct net_buf *nb);
 uint32_t nb_get_length(struct net_buf *nb);
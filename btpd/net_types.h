@@ -7,21 +7,72 @@ BTPDQ_HEAD(block_request_tq, block_request);
 BTPDQ_HEAD(blog_tq, blog);
 BTPDQ_HEAD(blog_record_tq, blog_record);
 
+#define MAXEGREQS 3     /* Peers a block may be requested from in end game */
+
+#define RARE_NONE UINT32_MAX
+
+/*
+ * Pieces in buckets by piece_count. Bucket c is pcs[start[c]] up to
+ * the start of bucket c + 1, or n for the last bucket.
+ */
+struct rare_index {
+    uint32_t *pcs;
+    uint32_t *start;
+    unsigned cap;
+    uint32_t n;
+};
+
 struct net {
     struct torrent *tp;
 
     int active;
     int endgame;
+    /*
+     * In end game the pieces that aren't fully downloaded are also
+     * kept in eg_bkts, by requests per missing block. No block is
+     * requested from more than MAXEGREQS peers, which bounds that.
+     */
+    struct piece_tq eg_bkts[MAXEGREQS + 1];
+    unsigned long long eg_dup_bytes;
 
     uint8_t *busy_field;
     uint32_t npcs_busy;
+    /*
+     * The missing pieces that only overlap skipped files and haven't
+     * been started. They're not wanted from any peer.
+     */
+    uint8_t *skip_field;
+    uint32_t npcs_skip;
     unsigned *piece_count;
     struct piece_tq getlst;
+    struct pctbl *pctbl;
+
+    /*
+     * The missing pieces that aren't skipped, ordered by piece_count.
+     * High priority pieces are in rare[1] and the rest in rare[0].
+     * rare_pos is a piece's position in its index, or RARE_NONE, and
+     * rare_high marks the pieces in rare[1].
+     */
+    struct rare_index rare[2];
+    uint32_t *rare_pos;
+    uint8_t *rare_high;
+
+    /*
+     * In stream mode the pieces from stream_head, the first piece we
+     * don't have, and a window forward are fetched before the rest.
+     * stream_t is when the head last moved.
+     */
+    int stream;
+    uint32_t stream_head;
+    long stream_t;
 
     unsigned long rate_up, rate_dwn;
     unsigned long long uploaded, downloaded;
+    unsigned long long req_timeouts, req_reassigned;
 
-    unsigned npeers;
+    unsigned npeers, npeers_dwn;
+    /* The pieces it takes to fill the pipelines of npeers_dwn. */
+    uint32_t npcs_pipe;
     struct peer_tq peers;
     struct mptbl *mptbl;
 };
@@ -33,7 +84,9 @@ enum input_state {
     BTP_MSGSIZE,
     BTP_MSGHEAD,
     BTP_PIECEMETA,
-    BTP_MSGBODY
+    BTP_MSGBODY,
+    BTP_PIECEBODY,
+    BTP_PIECESKIP
 };
 
 struct meta_peer {
@@ -46,6 +99,8 @@ struct meta_peer {
 
 HTBL_TYPE(mptbl, meta_peer, uint8_t, id, chain);
 
+HTBL_TYPE(pmsgtbl, nb_link, uint64_t, key, chain);
+
 struct peer {
     int sd;
     uint8_t *piece_field;
@@ -59,12 +114,21 @@ struct peer {
     struct meta_peer *mp;
 
     struct block_request_tq my_reqs;
+    struct reqtbl *reqtbl;
+    struct pmsgtbl *pmsgtbl;
 
     unsigned nreqs_out;
+    unsigned nreqs_max;
+    long rtt, rtt_prev;
+    long t_rtt;
+    long t_lastblock;
+    long t_snubbed;
     unsigned npiece_msgs;
 
     size_t outq_off;
     struct nb_tq outq;
+    struct nb_link *outq_ctl;
+    unsigned nctl_msgs, nbulk_msgs;
 
     struct fdev ioev;
 
@@ -91,6 +155,7 @@ struct peer {
     BTPDQ_ENTRY(peer) ul_entry;
     BTPDQ_ENTRY(peer) rq_entry;
     BTPDQ_ENTRY(peer) wq_entry;
+    BTPDQ_ENTRY(peer) fq_entry;
 };
 
 struct piece {
@@ -100,12 +165,19 @@ struct piece {
 
     unsigned nreqs;
 
+    int slow;
+
     unsigned nblocks;
     unsigned ngot;
     unsigned nbusy;
     unsigned next_block;
 
+    struct peer **holders;
+    unsigned nholders, holders_cap;
+
     struct net_buf **eg_reqs;
+    unsigned *eg_nreqs;
+    int eg_bkt;
     struct block_request_tq reqs;
     struct blog_tq logs;
 
@@ -113,12 +185,18 @@ struct piece {
     uint8_t *down_field;
 
     BTPDQ_ENTRY(piece) entry;
+    BTPDQ_ENTRY(piece) eg_entry;
+    HTBL_ENTRY(chain);
 };
 
+HTBL_TYPE(pctbl, piece, uint32_t, index, chain);
+
 struct blog {
     BTPDQ_ENTRY(blog) entry;
     struct blog_record_tq records;
     uint8_t *hashes;
+    int hashing;
+    int orphan;
 };
 
 struct blog_record {
@@ -130,8 +208,13 @@ struct blog_record {
 struct block_request {
     struct peer *p;
     struct net_buf *msg;
+    long t_sent;
+    uint64_t key;
+    HTBL_ENTRY(chain);
     BTPDQ_ENTRY(block_request) p_entry;
     BTPDQ_ENTRY(block_request) blk_entry;
 };
 
+HTBL_TYPE(reqtbl, block_request, uint64_t, key, chain);
+
 #endif
@@ -8,6 +8,7 @@ unsigned net_bw_limit_in;
 unsigned net_bw_limit_out;
 int net_port = 6881;
 off_t cm_alloc_size = 2048 * 1024;
+unsigned cm_hash_threads = 2;
 int ipcprot = 0600;
 int empty_start = 0;
 const char *tr_ip_arg;
@@ -9,6 +9,7 @@ extern unsigned net_bw_limit_in;
 extern unsigned net_bw_limit_out;
 extern int net_port;
 extern off_t cm_alloc_size;
+extern unsigned cm_hash_threads;
 extern int ipcprot;
 extern int empty_start;
 extern const char *tr_ip_arg;
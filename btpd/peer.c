@@ -2,6 +2,33 @@
 
 #include <ctype.h>
 
+/*
+ * Outstanding requests and queued piece messages are looked up on
+ * the piece index and the block offset.
+ */
+#define BLOCK_KEY(index, begin) (((uint64_t)(index) << 32) | (begin))
+
+static int
+block_key_eq(const void *k1, const void *k2)
+{
+    return *(const uint64_t *)k1 == *(const uint64_t *)k2;
+}
+
+static uint32_t
+block_key_hash(const void *k)
+{
+    uint64_t key = *(const uint64_t *)k;
+    return (uint32_t)(key >> 32) ^ (uint32_t)key;
+}
+
+static long
+peer_msecs(void)
+{
+    struct timespec ts;
+    evtimer_gettime(&ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 struct meta_peer *
 mp_create(void)
 {
@@ -53,6 +80,8 @@ peer_kill(struct peer *p)
         BTPDQ_REMOVE(&net_bw_readq, p, rq_entry);
     if (p->mp->flags & PF_ON_WRITEQ)
         BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
+    if (p->mp->flags & PF_ON_FLUSHQ)
+        BTPDQ_REMOVE(&net_flushq, p, fq_entry);
 
     btpd_ev_del(&p->ioev);
     close(p->sd);
@@ -61,14 +90,17 @@ peer_kill(struct peer *p)
     while (nl != NULL) {
         struct nb_link *next = BTPDQ_NEXT(nl, entry);
         nb_drop(nl->nb);
-        free(nl);
+        nb_link_free(nl);
         nl = next;
     }
 
+    reqtbl_free(p->reqtbl);
+    pmsgtbl_free(p->pmsgtbl);
+
     p->mp->p = NULL;
     mp_drop(p->mp, p->n);
     if (p->in.buf != NULL)
-        free(p->in.buf);
+        net_inbuf_put(p->in.buf, p->in.st_bytes);
     if (p->piece_field != NULL)
         free(p->piece_field);
     if (p->bad_field != NULL)
@@ -84,19 +116,76 @@ peer_set_in_state(struct peer *p, enum input_state state, size_t size)
     p->in.st_bytes = size;
 }
 
+/*
+ * Returns the last link of a bulk message that has begun to be sent,
+ * if there is one. Nothing may be put between it and its start.
+ */
+static struct nb_link *
+peer_outq_started(struct peer *p)
+{
+    struct nb_link *nl = BTPDQ_FIRST(&p->outq);
+    if (nl == NULL || !nb_is_bulk(nl->nb))
+        return NULL;
+    else if (nl->nb->type == NB_TORRENTDATA)
+        return nl;
+    else if (p->outq_off > 0)
+        return nl->nb->type == NB_PIECE ? BTPDQ_NEXT(nl, entry) : nl;
+    else
+        return NULL;
+}
+
+/*
+ * Control messages are put after the ones already queued, but ahead of
+ * all bulk data that hasn't started to go out. outq_ctl points to the
+ * last link of that prefix of the outq.
+ */
 void
 peer_send(struct peer *p, struct net_buf *nb)
 {
-    struct nb_link *nl = btpd_calloc(1, sizeof(*nl));
-    nl->nb = nb;
+    struct nb_link *nl = nb_link_create(nb);
     nb_hold(nb);
 
     if (BTPDQ_EMPTY(&p->outq)) {
         assert(p->outq_off == 0);
         btpd_ev_enable(&p->ioev, EV_WRITE);
         p->t_wantwrite = btpd_seconds;
+        net_write_soon(p);
+    }
+    if (nb_is_bulk(nb)) {
+        BTPDQ_INSERT_TAIL(&p->outq, nl, entry);
+        if (nb->type == NB_PIECE) {
+            nl->key = BLOCK_KEY(nb_get_index(nb), nb_get_begin(nb));
+            pmsgtbl_insert(p->pmsgtbl, nl);
+        } else
+            p->nbulk_msgs++;
+    } else {
+        struct nb_link *after = p->outq_ctl;
+        if (after == NULL)
+            after = peer_outq_started(p);
+        if (after == NULL)
+            BTPDQ_INSERT_HEAD(&p->outq, nl, entry);
+        else
+            BTPDQ_INSERT_AFTER(&p->outq, after, nl, entry);
+        p->outq_ctl = nl;
+        p->nctl_msgs++;
     }
-    BTPDQ_INSERT_TAIL(&p->outq, nl, entry);
+}
+
+/*
+ * Bookkeeping for a link leaving the outq, sent or not.
+ */
+void
+peer_outq_remove(struct peer *p, struct nb_link *nl)
+{
+    if (nl == p->outq_ctl)
+        p->outq_ctl = BTPDQ_PREV(nl, nb_tq, entry);
+    if (!nb_is_bulk(nl->nb))
+        p->nctl_msgs--;
+    else if (nl->nb->type == NB_PIECE)
+        pmsgtbl_remove(p->pmsgtbl, &nl->key);
+    else
+        p->nbulk_msgs--;
+    BTPDQ_REMOVE(&p->outq, nl, entry);
 }
 
 /*
@@ -110,13 +199,13 @@ int
 peer_unsend(struct peer *p, struct nb_link *nl)
 {
     if (!(nl == BTPDQ_FIRST(&p->outq) && p->outq_off > 0)) {
-        BTPDQ_REMOVE(&p->outq, nl, entry);
+        peer_outq_remove(p, nl);
         if (nl->nb->type == NB_TORRENTDATA) {
             assert(p->npiece_msgs > 0);
             p->npiece_msgs--;
         }
         nb_drop(nl->nb);
-        free(nl);
+        nb_link_free(nl);
         if (BTPDQ_EMPTY(&p->outq)) {
             if (p->mp->flags & PF_ON_WRITEQ) {
                 BTPDQ_REMOVE(&net_bw_writeq, p, wq_entry);
@@ -129,6 +218,19 @@ peer_unsend(struct peer *p, struct nb_link *nl)
         return 0;
 }
 
+/*
+ * A request is timed from when it's written to the peer, so time spent
+ * in our own outq doesn't count toward the rtt or the timeout.
+ */
+static void
+peer_req_sent(struct peer *p, struct net_buf *nb)
+{
+    uint64_t key = BLOCK_KEY(nb_get_index(nb), nb_get_begin(nb));
+    struct block_request *req = reqtbl_find(p->reqtbl, &key);
+    if (req != NULL && req->msg == nb)
+        req->t_sent = peer_msecs();
+}
+
 void
 peer_sent(struct peer *p, struct net_buf *nb)
 {
@@ -159,6 +261,7 @@ peer_sent(struct peer *p, struct net_buf *nb)
     case NB_REQUEST:
         btpd_log(BTPD_L_MSG, "sent request(%u,%u,%u) to %p\n",
             nb_get_index(nb), nb_get_begin(nb), nb_get_length(nb), p);
+        peer_req_sent(p, nb);
         break;
     case NB_PIECE:
         btpd_log(BTPD_L_MSG, "sent piece(%u,%u,%u) to %p\n",
@@ -188,21 +291,32 @@ peer_sent(struct peer *p, struct net_buf *nb)
 void
 peer_request(struct peer *p, struct block_request *req)
 {
-    assert(p->nreqs_out < MAXPIPEDREQUESTS);
+    assert(p->nreqs_out < p->nreqs_max);
     p->nreqs_out++;
+    req->t_sent = -1;
+    req->key = BLOCK_KEY(nb_get_index(req->msg), nb_get_begin(req->msg));
     BTPDQ_INSERT_TAIL(&p->my_reqs, req, p_entry);
+    reqtbl_insert(p->reqtbl, req);
     peer_send(p, req->msg);
 }
 
+/*
+ * Forget about an outstanding request. Nothing is sent to the peer.
+ */
+void
+peer_req_remove(struct peer *p, struct block_request *req)
+{
+    assert(p->nreqs_out > 0);
+    p->nreqs_out--;
+    BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
+    reqtbl_remove(p->reqtbl, &req->key);
+}
+
 int
 peer_requested(struct peer *p, uint32_t piece, uint32_t block)
 {
-    uint32_t begin = block * PIECE_BLOCKLEN;
-    struct block_request *req;
-    BTPDQ_FOREACH(req, &p->my_reqs, p_entry)
-        if (nb_get_index(req->msg) == piece && nb_get_begin(req->msg) == begin)
-            return 1;
-    return 0;
+    uint64_t key = BLOCK_KEY(piece, block * PIECE_BLOCKLEN);
+    return reqtbl_find(p->reqtbl, &key) != NULL;
 }
 
 void
@@ -211,26 +325,53 @@ peer_keepalive(struct peer *p)
     peer_send(p, nb_create_keepalive());
 }
 
-void
-peer_cancel(struct peer *p, struct block_request *req, struct net_buf *nb)
+/*
+ * Take back the request if it hasn't been sent, otherwise send the
+ * cancel message nb.
+ */
+static void
+peer_unrequest(struct peer *p, struct block_request *req, struct net_buf *nb)
 {
-    BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
-    p->nreqs_out--;
-
+    // Requests are control messages, so they're found before outq_ctl.
     int removed = 0;
-    struct nb_link *nl;
-    BTPDQ_FOREACH(nl, &p->outq, entry) {
+    struct nb_link *nl = p->outq_ctl != NULL ? BTPDQ_FIRST(&p->outq) : NULL;
+    while (nl != NULL) {
         if (nl->nb == req->msg) {
             removed = peer_unsend(p, nl);
             break;
         }
+        nl = nl == p->outq_ctl ? NULL : BTPDQ_NEXT(nl, entry);
     }
     if (!removed)
         peer_send(p, nb);
+}
+
+void
+peer_cancel(struct peer *p, struct block_request *req, struct net_buf *nb)
+{
+    peer_req_remove(p, req);
+    peer_unrequest(p, req, nb);
     if (p->nreqs_out == 0)
         peer_on_no_reqs(p);
 }
 
+/*
+ * Cancel all outstanding requests with the peer. The requests are
+ * left in place for the download code to unassign.
+ */
+void
+peer_cancel_reqs(struct peer *p)
+{
+    struct block_request *req;
+    BTPDQ_FOREACH(req, &p->my_reqs, p_entry) {
+        struct net_buf *nb = nb_create_cancel(nb_get_index(req->msg),
+            nb_get_begin(req->msg), nb_get_length(req->msg));
+        nb_hold(nb);
+        peer_unrequest(p, req, nb);
+        nb_drop(nb);
+    }
+}
+
 void
 peer_unchoke(struct peer *p)
 {
@@ -257,21 +398,19 @@ peer_choke(struct peer *p)
     peer_send(p, nb_create_choke());
 }
 
-void
-peer_want(struct peer *p, uint32_t index)
+static void
+peer_want_more(struct peer *p, uint32_t count)
 {
-    if (!has_bit(p->piece_field, index) || peer_has_bad(p, index))
-        return;
-    assert(p->nwant < p->npieces);
-    p->nwant++;
-    if (p->nwant == 1) {
+    assert(p->nwant + count <= p->npieces);
+    p->nwant += count;
+    if (p->nwant == count) {
         p->mp->flags |= PF_I_WANT;
         if (p->mp->flags & PF_SUSPECT)
             return;
         if (p->nreqs_out == 0) {
             assert((p->mp->flags & PF_DO_UNWANT) == 0);
             int unsent = 0;
-            struct nb_link *nl = BTPDQ_LAST(&p->outq, nb_tq);
+            struct nb_link *nl = p->outq_ctl;
             if (nl != NULL && nl->nb->type == NB_UNINTEREST)
                 unsent = peer_unsend(p, nl);
             if (!unsent)
@@ -283,13 +422,11 @@ peer_want(struct peer *p, uint32_t index)
     }
 }
 
-void
-peer_unwant(struct peer *p, uint32_t index)
+static void
+peer_want_less(struct peer *p, uint32_t count)
 {
-    if (!has_bit(p->piece_field, index) || peer_has_bad(p, index))
-        return;
-    assert(p->nwant > 0);
-    p->nwant--;
+    assert(p->nwant >= count);
+    p->nwant -= count;
     if (p->nwant == 0) {
         p->mp->flags &= ~PF_I_WANT;
         if (p->mp->flags & PF_SUSPECT)
@@ -302,6 +439,43 @@ peer_unwant(struct peer *p, uint32_t index)
     }
 }
 
+void
+peer_want(struct peer *p, uint32_t index)
+{
+    if (has_bit(p->piece_field, index) && !peer_has_bad(p, index))
+        peer_want_more(p, 1);
+}
+
+void
+peer_unwant(struct peer *p, uint32_t index)
+{
+    if (has_bit(p->piece_field, index) && !peer_has_bad(p, index))
+        peer_want_less(p, 1);
+}
+
+/*
+ * The same as calling peer_want, or peer_unwant, for every piece set
+ * in field, but done a byte of the peer's bitfield at a time.
+ */
+void
+peer_want_field(struct peer *p, const uint8_t *field, int want)
+{
+    uint32_t count = 0;
+    size_t len = ceil(p->n->tp->npieces / 8.0);
+    for (size_t i = 0; i < len; i++) {
+        unsigned bits = p->piece_field[i] & field[i];
+        if (p->bad_field != NULL)
+            bits &= ~p->bad_field[i];
+        count += __builtin_popcount(bits);
+    }
+    if (count == 0)
+        return;
+    if (want)
+        peer_want_more(p, count);
+    else
+        peer_want_less(p, count);
+}
+
 static struct peer *
 peer_create_common(int sd)
 {
@@ -316,12 +490,19 @@ peer_create_common(int sd)
     p->t_created = btpd_seconds;
     p->t_lastwrite = btpd_seconds;
     p->t_nointerest = btpd_seconds;
+    p->nreqs_max = MINPIPEDREQUESTS;
+    p->rtt = p->rtt_prev = -1;
+    p->t_rtt = btpd_seconds;
     BTPDQ_INIT(&p->my_reqs);
     BTPDQ_INIT(&p->outq);
+    p->reqtbl = reqtbl_create(1, block_key_eq, block_key_hash);
+    p->pmsgtbl = pmsgtbl_create(1, block_key_eq, block_key_hash);
+    if (p->reqtbl == NULL || p->pmsgtbl == NULL)
+        btpd_err("Out of memory.\n");
 
     peer_set_in_state(p, SHAKE_PSTR, 28);
 
-    btpd_ev_new(&p->ioev, p->sd, EV_READ, net_io_cb, p);
+    btpd_ev_new(&p->ioev, p->sd, EV_READ|EV_EDGE, net_io_cb, p);
 
     BTPDQ_INSERT_TAIL(&net_unattached, p, p_entry);
     net_npeers++;
@@ -462,7 +643,7 @@ peer_on_unchoke(struct peer *p)
     if ((p->mp->flags & PF_P_CHOKE) == 0)
         return;
     else {
-        p->mp->flags &= ~PF_P_CHOKE;
+        p->mp->flags &= ~(PF_P_CHOKE|PF_SNUBBED);
         dl_on_unchoke(p);
     }
 }
@@ -517,28 +698,62 @@ peer_on_bitfield(struct peer *p, const uint8_t *field)
     }
 }
 
+static struct block_request *
+peer_find_req(struct peer *p, uint32_t index, uint32_t begin, uint32_t length)
+{
+    uint64_t key = BLOCK_KEY(index, begin);
+    struct block_request *req = reqtbl_find(p->reqtbl, &key);
+    if (req != NULL && nb_get_length(req->msg) != length)
+        req = NULL;
+    return req;
+}
+
+/*
+ * Whether a piece message is for a block we're waiting for, so its
+ * body is worth keeping.
+ */
+int
+peer_expects_block(struct peer *p, uint32_t index, uint32_t begin,
+    uint32_t length)
+{
+    return peer_find_req(p, index, begin, length) != NULL;
+}
+
+void
+peer_on_piece_discard(struct peer *p, uint32_t index, uint32_t begin,
+    uint32_t length)
+{
+    btpd_log(BTPD_L_MSG, "discarded piece(%u,%u,%u) from %p\n",
+        index, begin, length, p);
+    if (p->n->endgame)
+        p->n->eg_dup_bytes += length;
+}
+
+/*
+ * The data buffer, from net_inbuf_get, is taken over and passed on to
+ * be written if we were waiting for the block.
+ */
 void
 peer_on_piece(struct peer *p, uint32_t index, uint32_t begin,
-    uint32_t length, const char *data)
+    uint32_t length, uint8_t *data)
 {
-    struct block_request *req;
-    BTPDQ_FOREACH(req, &p->my_reqs, p_entry)
-        if ((nb_get_begin(req->msg) == begin &&
-                nb_get_index(req->msg) == index &&
-                nb_get_length(req->msg) == length))
-            break;
+    struct block_request *req = peer_find_req(p, index, begin, length);
     if (req != NULL) {
         btpd_log(BTPD_L_MSG, "received piece(%u,%u,%u) from %p\n",
             index, begin, length, p);
-        assert(p->nreqs_out > 0);
-        p->nreqs_out--;
-        BTPDQ_REMOVE(&p->my_reqs, req, p_entry);
+        p->t_lastblock = peer_msecs();
+        long rtt = p->t_lastblock - req->t_sent;
+        if (req->t_sent >= 0 && (p->rtt < 0 || rtt < p->rtt))
+            p->rtt = rtt;
+        peer_req_remove(p, req);
         if (p->nreqs_out == 0)
             peer_on_no_reqs(p);
         dl_on_block(p, req, index, begin, length, data);
-    } else
-        btpd_log(BTPD_L_MSG, "discarded piece(%u,%u,%u) from %p\n",
-            index, begin, length, p);
+    } else {
+        peer_on_piece_discard(p, index, begin, length);
+        if (data != NULL)
+            net_inbuf_put((char *)data, length);
+    }
 }
 
 void
@@ -547,9 +762,15 @@ peer_on_request(struct peer *p, uint32_t index, uint32_t begin,
 {
     btpd_log(BTPD_L_MSG, "received request(%u,%u,%u) from %p\n",
         index, begin, length, p);
+    uint64_t key = BLOCK_KEY(index, begin);
+    if (pmsgtbl_find(p->pmsgtbl, &key) != NULL) {
+        btpd_log(BTPD_L_MSG, "duplicate request(%u,%u,%u) from %p\n",
+            index, begin, length, p);
+        return;
+    }
     if ((p->mp->flags & PF_NO_REQUESTS) == 0) {
         peer_send(p, nb_create_piece(index, begin, length));
-        peer_send(p, nb_create_torrentdata());
+        peer_send(p, nb_create_torrentdata(index, begin, length));
         p->npiece_msgs++;
         if (p->npiece_msgs >= MAXPIECEMSGS) {
             peer_send(p, nb_create_choke());
@@ -565,17 +786,79 @@ peer_on_cancel(struct peer *p, uint32_t index, uint32_t begin,
 {
     btpd_log(BTPD_L_MSG, "received cancel(%u,%u,%u) from %p\n",
         index, begin, length, p);
-    struct nb_link *nl;
-    BTPDQ_FOREACH(nl, &p->outq, entry)
-        if (nl->nb->type == NB_PIECE
-            && nb_get_begin(nl->nb) == begin
-            && nb_get_index(nl->nb) == index
-            && nb_get_length(nl->nb) == length) {
-            struct nb_link *data = BTPDQ_NEXT(nl, entry);
-            if (peer_unsend(p, nl))
-                peer_unsend(p, data);
-            break;
-        }
+    uint64_t key = BLOCK_KEY(index, begin);
+    struct nb_link *nl = pmsgtbl_find(p->pmsgtbl, &key);
+    if (nl != NULL && nb_get_length(nl->nb) == length) {
+        struct nb_link *data = BTPDQ_NEXT(nl, entry);
+        if (peer_unsend(p, nl))
+            peer_unsend(p, data);
+    }
+}
+
+/*
+ * Aim for twice the bandwidth delay product of requests in flight.
+ * The delay is the shortest time from request to block seen in the
+ * last one or two windows, so requests waiting in the peer's queue
+ * don't count. The slack lets the download rate, and with it the
+ * depth, grow until the peer or the path is the limit.
+ */
+static void
+peer_update_pipeline(struct peer *p)
+{
+    long rtt = p->rtt_prev;
+    if (rtt < 0 || (p->rtt >= 0 && p->rtt < rtt))
+        rtt = p->rtt;
+    if (btpd_seconds - p->t_rtt >= PIPERTTWINDOW) {
+        p->rtt_prev = p->rtt;
+        p->rtt = -1;
+        p->t_rtt = btpd_seconds;
+    }
+    if (rtt < 0)
+        return;
+
+    unsigned long long bdp =
+        (unsigned long long)(p->rate_dwn / RATEHISTORY) * rtt / 1000;
+    unsigned long depth = 2 * bdp / PIECE_BLOCKLEN + 1;
+    if (depth < MINPIPEDREQUESTS)
+        depth = MINPIPEDREQUESTS;
+    else if (depth > MAXPIPEDREQUESTS)
+        depth = MAXPIPEDREQUESTS;
+    if (depth != p->nreqs_max)
+        btpd_log(BTPD_L_POL, "pipeline depth %lu for %p (rtt %ld ms).\n",
+            depth, p, rtt);
+    p->nreqs_max = depth;
+}
+
+/*
+ * The oldest outstanding request should be answered within a few
+ * block transfer times, at the peer's download rate, of the previous
+ * block. The allowance is kept between REQTIMEOUTMIN and REQTIMEOUTMAX.
+ */
+static int
+peer_req_timed_out(struct peer *p)
+{
+    struct block_request *req = BTPDQ_FIRST(&p->my_reqs);
+    unsigned long rate = p->rate_dwn / RATEHISTORY;
+    long timeout, since;
+
+    if (req == NULL || req->t_sent < 0)
+        return 0;
+    timeout = rate > 0 ? 4000L * PIECE_BLOCKLEN / rate : REQTIMEOUTMAX * 1000;
+    if (timeout < REQTIMEOUTMIN * 1000)
+        timeout = REQTIMEOUTMIN * 1000;
+    else if (timeout > REQTIMEOUTMAX * 1000)
+        timeout = REQTIMEOUTMAX * 1000;
+    since = max(req->t_sent, p->t_lastblock);
+    return peer_msecs() - since >= timeout;
+}
+
+static void
+peer_on_snub(struct peer *p)
+{
+    btpd_log(BTPD_L_POL, "%u requests to %p timed out.\n", p->nreqs_out, p);
+    p->mp->flags |= PF_SNUBBED;
+    p->t_snubbed = btpd_seconds;
+    dl_on_snub(p);
 }
 
 void
@@ -584,6 +867,15 @@ peer_on_tick(struct peer *p)
     if (p->mp->flags & PF_BANNED)
         goto kill;
     if (p->mp->flags & PF_ATTACHED) {
+        peer_update_pipeline(p);
+        if (p->n->active && peer_req_timed_out(p))
+            peer_on_snub(p);
+        else if ((p->mp->flags & PF_SNUBBED
+                && btpd_seconds - p->t_snubbed >= SNUBPENALTY)) {
+            p->mp->flags &= ~PF_SNUBBED;
+            if (peer_leech_ok(p))
+                dl_on_download(p);
+        }
         if (BTPDQ_EMPTY(&p->outq)) {
             if (btpd_seconds - p->t_lastwrite >= 120)
                 peer_keepalive(p);
@@ -672,7 +964,7 @@ peer_has_bad(struct peer *p, uint32_t index)
 int
 peer_laden(struct peer *p)
 {
-    return p->nreqs_out >= MAXPIPEDREQUESTS;
+    return p->nreqs_out >= p->nreqs_max;
 }
 
 int
@@ -684,7 +976,8 @@ peer_wanted(struct peer *p)
 int
 peer_leech_ok(struct peer *p)
 {
-    return (p->mp->flags & (PF_BANNED|PF_SUSPECT|PF_I_WANT|PF_P_CHOKE))
+    return (p->mp->flags &
+        (PF_BANNED|PF_SUSPECT|PF_SNUBBED|PF_I_WANT|PF_P_CHOKE))
         == PF_I_WANT && !peer_laden(p);
 }
 
@@ -13,13 +13,21 @@
 #define PF_DO_UNWANT    0x200
 #define PF_SUSPECT      0x400
 #define PF_BANNED       0x800
+#define PF_ON_FLUSHQ   0x1000
+#define PF_SNUBBED     0x2000   /* The peer didn't send what we requested */
 
 #define MAXPIECEMSGS 128
-#define MAXPIPEDREQUESTS 10
+#define MINPIPEDREQUESTS 10
+#define MAXPIPEDREQUESTS 256
+#define PIPERTTWINDOW 10
+#define REQTIMEOUTMIN 15
+#define REQTIMEOUTMAX 60
+#define SNUBPENALTY 60
 
 void peer_set_in_state(struct peer *p, enum input_state state, size_t size);
 
 void peer_send(struct peer *p, struct net_buf *nb);
+void peer_outq_remove(struct peer *p, struct nb_link *nl);
 int peer_unsend(struct peer *p, struct nb_link *nl);
 void peer_sent(struct peer *p, struct net_buf *nb);
 
@@ -28,10 +36,13 @@ void peer_unchoke(struct peer *p);
 void peer_choke(struct peer *p);
 void peer_unwant(struct peer *p, uint32_t index);
 void peer_want(struct peer *p, uint32_t index);
+void peer_want_field(struct peer *p, const uint8_t *field, int want);
 void peer_request(struct peer *p, struct block_request *req);
 void peer_cancel(struct peer *p, struct block_request *req,
     struct net_buf *nb);
+void peer_cancel_reqs(struct peer *p);
 
+void peer_req_remove(struct peer *p, struct block_request *req);
 int peer_requested(struct peer *p, uint32_t piece, uint32_t block);
 
 void peer_create_in(int sd);
@@ -49,8 +60,12 @@ void peer_on_choke(struct peer *p);
 void peer_on_unchoke(struct peer *p);
 void peer_on_have(struct peer *p, uint32_t index);
 void peer_on_bitfield(struct peer *p, const uint8_t *field);
+int peer_expects_block(struct peer *p, uint32_t index, uint32_t begin,
+    uint32_t length);
+void peer_on_piece_discard(struct peer *p, uint32_t index, uint32_t begin,
+    uint32_t length);
 void peer_on_piece(struct peer *p, uint32_t index, uint32_t begin,
-    uint32_t length, const char *data);
+    uint32_t length, uint8_t *data);
 void peer_on_request(struct peer *p, uint32_t index, uint32_t begin,
     uint32_t length);
 void peer_on_cancel(struct peer *p, uint32_t index, uint32_t begin,
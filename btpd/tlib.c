@@ -53,6 +53,8 @@ tlib_kill(struct tlib *tl)
         free(tl->dir);
     if (tl->label != NULL)
         free(tl->label);
+    if (tl->fprio != NULL)
+        free(tl->fprio);
     free(tl);
     m_ntlibs--;
 }
@@ -151,11 +153,11 @@ valid_info(char *buf, size_t len)
 static void
 load_info(struct tlib *tl, const char *path)
 {
-    size_t size = 1 << 14;
-    char buf[size];
+    size_t size = 0;
+    char *buf;
     const char *info;
 
-    if (read_file(path, buf, &size) == NULL) {
+    if ((buf = read_file(path, NULL, &size)) == NULL) {
         btpd_log(BTPD_L_ERROR, "couldn't load '%s' (%s).\n", path,
             strerror(errno));
         return;
@@ -163,6 +165,7 @@ load_info(struct tlib *tl, const char *path)
 
     if (!valid_info(buf, size)) {
         btpd_log(BTPD_L_ERROR, "bad info file '%s'.\n", path);
+        free(buf);
         return;
     }
 
@@ -174,6 +177,8 @@ load_info(struct tlib *tl, const char *path)
     tl->tot_down = benc_dget_int(info, "total download");
     tl->content_size = benc_dget_int(info, "content size");
     tl->content_have = benc_dget_int(info, "content have");
+    tl->fprio = benc_dget_str(info, "file priorities", &tl->nfprio);
+    free(buf);
     if (tl->name == NULL || tl->dir == NULL)
         btpd_err("Out of memory.\n");
 }
@@ -188,12 +193,18 @@ save_info(struct tlib *tl)
     iobuf_print(&iob,
         "d4:infod"
         "12:content havei%llde12:content sizei%llde"
-        "3:dir%d:%s4:name%d:%s"
+        "3:dir%d:%s",
+        (long long)tl->content_have, (long long)tl->content_size,
+        (int)strlen(tl->dir), tl->dir);
+    if (tl->fprio != NULL)
+        iobuf_print(&iob, "15:file priorities%d:%s",
+            (int)tl->nfprio, tl->fprio);
+    iobuf_print(&iob,
+        "4:name%d:%s"
         "5:label%d:%s"
         "14:total downloadi%llde12:total uploadi%llde"
         "ee",
-        (long long)tl->content_have, (long long)tl->content_size,
-        (int)strlen(tl->dir), tl->dir, (int)strlen(tl->name), tl->name,
+        (int)strlen(tl->name), tl->name,
         (int)strlen(tl->label), tl->label,
         tl->tot_down, tl->tot_up);
     if (iob.error)
@@ -231,6 +242,40 @@ tlib_update_info(struct tlib *tl, int only_file)
     save_info(tl);
 }
 
+/*
+ * The file priorities are kept as a string with a digit for each
+ * file, and its length in nfprio. It's left out while all files have
+ * normal priority.
+ */
+int
+tlib_fprio(struct tlib *tl, unsigned nfiles, unsigned file)
+{
+    int prio;
+    if (tl->fprio == NULL || tl->nfprio != nfiles)
+        return IPC_FPRIO_NORMAL;
+    prio = tl->fprio[file] - '0';
+    return prio >= IPC_FPRIO_SKIP && prio <= IPC_FPRIO_HIGH ?
+        prio : IPC_FPRIO_NORMAL;
+}
+
+void
+tlib_set_fprio(struct tlib *tl, unsigned nfiles, unsigned file, int prio)
+{
+    if (tl->fprio == NULL || tl->nfprio != nfiles) {
+        if (tl->fprio != NULL)
+            free(tl->fprio);
+        tl->fprio = btpd_malloc(nfiles + 1);
+        memset(tl->fprio, '0' + IPC_FPRIO_NORMAL, nfiles);
+        tl->fprio[nfiles] = '\0';
+        tl->nfprio = nfiles;
+    }
+    tl->fprio[file] = '0' + prio;
+    if (tl->tp != NULL)
+        tlib_update_info(tl, 1);
+    else
+        save_info(tl);
+}
+
 static void
 write_torrent(const char *mi, size_t mi_size, const char *path)
 {
@@ -367,11 +412,18 @@ tlib_load_mi(struct tlib *tl, char **res)
     return 0;
 }
 
+/*
+ * The resume file holds, after its header, the size and mtime of each
+ * file, the piece field, the block field and, since version 3, the
+ * test field. The test field marks the pieces a startup test still
+ * has to check, so an interrupted test can be picked up again.
+ */
 struct resume_data {
     void *base;
     size_t size;
     uint8_t *pc_field;
     uint8_t *blk_field;
+    uint8_t *test_field;
 };
 
 static void *
@@ -392,7 +444,7 @@ init_resume(int fd, size_t size)
     char buf[1024];
     uint32_t ver;
     bzero(buf, sizeof(buf));
-    enc_be32(&ver, 2);
+    enc_be32(&ver, 3);
     if (write(fd, "RESD", 4) == -1 || write(fd, &ver, 4) == -1)
         goto fatal;
     size -= 8;
@@ -413,18 +465,27 @@ tlib_open_resume(struct tlib *tl, unsigned nfiles, size_t pfsize,
 {
     int fd;
     char relpath[RELPATH_SIZE];
+    char head[8];
     struct stat sb;
     struct resume_data *resd = btpd_calloc(1, sizeof(*resd));
     bin2hex(tl->hash, relpath, 20);
 
-    resd->size = 8 + nfiles * 16 + pfsize + bfsize;
+    resd->size = 8 + nfiles * 16 + 2 * pfsize + bfsize;
 
     if ((errno =
             vopen(&fd, O_RDWR|O_CREAT, "torrents/%s/resume", relpath)) != 0)
         goto fatal;
     if (fstat(fd, &sb) != 0)
         goto fatal;
-    if (sb.st_size != resd->size) {
+    if (sb.st_size == resd->size - pfsize && pread(fd, head, 8, 0) == 8
+            && bcmp(head, "RESD", 4) == 0 && dec_be32(head + 4) == 2) {
+        // A version 2 file only lacks the test field, which is zero
+        // when no test is in progress.
+        uint32_t ver;
+        enc_be32(&ver, 3);
+        if (ftruncate(fd, resd->size) != 0 || pwrite(fd, &ver, 4, 4) != 4)
+            goto fatal;
+    } else if (sb.st_size != resd->size) {
         if (sb.st_size != 0 && ftruncate(fd, 0) != 0)
             goto fatal;
         init_resume(fd, resd->size);
@@ -433,12 +494,13 @@ tlib_open_resume(struct tlib *tl, unsigned nfiles, size_t pfsize,
         mmap(NULL, resd->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
     if (resd->base == MAP_FAILED)
         goto fatal;
-    if (bcmp(resd->base, "RESD", 4) != 0 || dec_be32(resd->base + 4) != 2)
+    if (bcmp(resd->base, "RESD", 4) != 0 || dec_be32(resd->base + 4) != 3)
         init_resume(fd, resd->size);
     close(fd);
 
     resd->pc_field = resd->base + 8 + nfiles * 16;
     resd->blk_field = resd->pc_field + pfsize;
+    resd->test_field = resd->blk_field + bfsize;
 
     return resd;
 fatal:
@@ -458,6 +520,12 @@ resume_block_field(struct resume_data *resd)
     return resd->blk_field;
 }
 
+uint8_t *
+resume_test_field(struct resume_data *resd)
+{
+    return resd->test_field;
+}
+
 void
 resume_set_fts(struct resume_data *resd, int i, struct file_time_size *fts)
 {
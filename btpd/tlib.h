@@ -9,6 +9,8 @@ struct tlib {
     char *name;
     char *dir;
     char *label;
+    char *fprio;
+    size_t nfprio;
 
     unsigned long long tot_up, tot_down;
     off_t content_size, content_have;
@@ -36,6 +38,10 @@ void tlib_kill(struct tlib *tl);
 
 void tlib_update_info(struct tlib *tl, int only_file);
 
+int tlib_fprio(struct tlib *tl, unsigned nfiles, unsigned file);
+void tlib_set_fprio(struct tlib *tl, unsigned nfiles, unsigned file,
+    int prio);
+
 struct tlib *tlib_by_hash(const uint8_t *hash);
 struct tlib *tlib_by_num(unsigned num);
 unsigned tlib_count(void);
@@ -51,6 +57,7 @@ void tlib_close_resume(struct resume_data *resume);
 
 uint8_t *resume_piece_field(struct resume_data *resd);
 uint8_t *resume_block_field(struct resume_data *resd);
+uint8_t *resume_test_field(struct resume_data *resd);
 void resume_set_fts(struct resume_data *resd, int i,
     struct file_time_size *fts);
 void resume_get_fts(struct resume_data *resd, int i,
@@ -33,6 +33,15 @@ btpd_calloc(size_t nmemb, size_t size)
     return a;
 }
 
+void *
+btpd_realloc(void *ptr, size_t size)
+{
+    void *a;
+    if ((a = realloc(ptr, size)) == NULL)
+        btpd_err("Failed to allocate %d bytes.\n", (int)size);
+    return a;
+}
+
 void
 btpd_ev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
 {
@@ -61,6 +70,13 @@ btpd_ev_disable(struct fdev *ev, uint16_t flags)
         btpd_err("Failed to disable event (%s).\n", strerror(errno));
 }
 
+void
+btpd_ev_again(struct fdev *ev, uint16_t flags)
+{
+    if (fdev_again(ev, flags) != 0)
+        btpd_err("Failed to rearm event (%s).\n", strerror(errno));
+}
+
 void
 btpd_timer_add(struct timeout *to, struct timespec *ts)
 {
@@ -115,10 +115,12 @@ static struct {
     { "del", cmd_del, usage_del },
     { "kill", cmd_kill, usage_kill },
     { "list", cmd_list, usage_list },
+    { "prio", cmd_prio, usage_prio },
     { "rate", cmd_rate, usage_rate },
     { "start", cmd_start, usage_start },
     { "stop", cmd_stop, usage_stop },
-    { "stat", cmd_stat, usage_stat }
+    { "stat", cmd_stat, usage_stat },
+    { "stream", cmd_stream, usage_stream }
 };
 
 static void
@@ -141,10 +143,12 @@ usage(void)
         "del\t- Remove torrents from btpd.\n"
         "kill\t- Shut down btpd.\n"
         "list\t- List torrents.\n"
+        "prio\t- Set the priority of files in a torrent.\n"
         "rate\t- Set up/download rate limits.\n"
         "start\t- Activate torrents.\n"
         "stat\t- Display stats for active torrents.\n"
         "stop\t- Deactivate torrents.\n"
+        "stream\t- Download torrents in order for streaming.\n"
         "\n"
         "Note:\n"
         "Torrents can be specified either with its number or its file.\n"
@@ -33,6 +33,8 @@ struct item {
     char st;
     long long cgot, csize, totup, downloaded, uploaded, rate_up, rate_down;
     uint32_t torrent_pieces, pieces_have, pieces_seen;
+    unsigned req_depth;
+    unsigned test_queue;
     BTPDQ_ENTRY(item) entry;
 };
 
@@ -95,6 +97,9 @@ list_cb(int obji, enum ipc_err objerr, struct ipc_get_res *res, void *arg)
     itm->torrent_pieces = (uint32_t)res[IPC_TVAL_PCCOUNT].v.num;
     itm->pieces_seen    = (uint32_t)res[IPC_TVAL_PCSEEN].v.num;
     itm->pieces_have    = (uint32_t)res[IPC_TVAL_PCGOT].v.num;
+    itm->req_depth      = res[IPC_TVAL_REQDEPTH].type == IPC_TYPE_ERR ?
+        0 : (unsigned)res[IPC_TVAL_REQDEPTH].v.num;
+    itm->test_queue     = (unsigned)res[IPC_TVAL_TESTQ].v.num;
 
     itm_insert(itms, itm);
 }
@@ -123,12 +128,14 @@ print_items(struct items* itms, char *format)
                             case 'U': printf("%lld", p->uploaded);       break;
                             case 'T': printf("%u",   p->torrent_pieces); break;
 
+                            case 'c': printf("%u",   p->test_queue);     break;
                             case 'd': printf("%s",   p->dir);            break;
                             case 'g': printf("%lld", p->cgot);           break;
                             case 'h': printf("%s",   p->hash);           break;
                             case 'l': printf("%s",   p->label);          break;
                             case 'n': printf("%s",   p->name);           break;
                             case 'p': print_percent(p->cgot, p->csize);  break;
+                            case 'q': printf("%u",   p->req_depth);      break;
                             case 'r': print_ratio(p->totup, p->csize);   break;
                             case 's': print_size(p->csize);              break;
                             case 't': printf("%c",   p->st);             break;
@@ -176,7 +183,7 @@ cmd_list(int argc, char **argv)
            IPC_TVAL_TOTUP,   IPC_TVAL_CSIZE,  IPC_TVAL_CGOT,    IPC_TVAL_PCOUNT,
            IPC_TVAL_PCCOUNT, IPC_TVAL_PCSEEN, IPC_TVAL_PCGOT,   IPC_TVAL_SESSUP,
            IPC_TVAL_SESSDWN, IPC_TVAL_RATEUP, IPC_TVAL_RATEDWN, IPC_TVAL_IHASH,
-           IPC_TVAL_DIR, IPC_TVAL_LABEL };
+           IPC_TVAL_DIR, IPC_TVAL_LABEL, IPC_TVAL_REQDEPTH, IPC_TVAL_TESTQ };
     size_t nkeys = ARRAY_COUNT(keys);
     struct items itms;
     while ((ch = getopt_long(argc, argv, "aif:", list_opts, NULL)) != -1) {
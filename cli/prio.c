@@ -0,0 +1,67 @@
+#include "btcli.h"
+
+void
+usage_prio(void)
+{
+    printf(
+        "Set the priority of files in a torrent.\n"
+        "\n"
+        "Usage: prio torrent priority file ...\n"
+        "\n"
+        "Arguments:\n"
+        "torrent\n"
+        "\tThe torrent the files belong to.\n"
+        "\n"
+        "priority\n"
+        "\tOne of skip, normal or high. Skipped files aren't downloaded\n"
+        "\tand pieces in high priority files are downloaded first.\n"
+        "\n"
+        "file ...\n"
+        "\tThe numbers of the files, counting from 0 in the order\n"
+        "\tthey're listed by btinfo.\n"
+        "\n"
+        );
+    exit(1);
+}
+
+static struct option prio_opts [] = {
+    { "help", no_argument, NULL, 'H' },
+    {NULL, 0, NULL, 0}
+};
+
+void
+cmd_prio(int argc, char **argv)
+{
+    int ch;
+    enum ipc_fprio prio;
+    struct ipc_torrent t;
+
+    while ((ch = getopt_long(argc, argv, "", prio_opts, NULL)) != -1)
+        usage_prio();
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 3)
+        usage_prio();
+
+    if (strcmp(argv[1], "skip") == 0)
+        prio = IPC_FPRIO_SKIP;
+    else if (strcmp(argv[1], "normal") == 0)
+        prio = IPC_FPRIO_NORMAL;
+    else if (strcmp(argv[1], "high") == 0)
+        prio = IPC_FPRIO_HIGH;
+    else
+        usage_prio();
+
+    if (!torrent_spec(argv[0], &t))
+        exit(1);
+
+    btpd_connect();
+    for (int i = 2; i < argc; i++) {
+        char *end;
+        unsigned long file = strtoul(argv[i], &end, 10);
+        if (end == argv[i] || *end != '\0' || file > UINT_MAX)
+            diemsg("bad file number '%s'.\n", argv[i]);
+        handle_ipc_res(btpd_prio(ipc, &t, file, prio), "prio", argv[i]);
+    }
+}
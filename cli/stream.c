@@ -0,0 +1,54 @@
+#include "btcli.h"
+
+void
+usage_stream(void)
+{
+    printf(
+        "Download torrents in order for streaming.\n"
+        "\n"
+        "Usage: stream [-o] torrent ...\n"
+        "\n"
+        "Arguments:\n"
+        "torrent ...\n"
+        "\tThe torrents to stream.\n"
+        "\n"
+        "Options:\n"
+        "-o, --off\n"
+        "\tGo back to downloading the rarest pieces first.\n"
+        "\n"
+        );
+    exit(1);
+}
+
+static struct option stream_opts [] = {
+    { "help", no_argument, NULL, 'H' },
+    { "off", no_argument, NULL, 'o' },
+    {NULL, 0, NULL, 0}
+};
+
+void
+cmd_stream(int argc, char **argv)
+{
+    int ch, on = 1;
+    struct ipc_torrent t;
+
+    while ((ch = getopt_long(argc, argv, "o", stream_opts, NULL)) != -1) {
+        switch (ch) {
+        case 'o':
+            on = 0;
+            break;
+        default:
+            usage_stream();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc == 0)
+        usage_stream();
+
+    btpd_connect();
+    for (int i = 0; i < argc; i++)
+        if (torrent_spec(argv[i], &t))
+            handle_ipc_res(btpd_stream(ipc, &t, on), "stream", argv[i]);
+}
@@ -23,4 +23,4 @@ DEFS = -DPACKAGE_NAME=\"${NAME}\" -DPACKAGE_VERSION=\"${VERSION}\"
 CC = gcc
 
 # excluded
-EVLOOP_SRC := ${filter-out evloop/epoll.c evloop/kqueue.c, ${EVLOOP_SRC}}
+EVLOOP_SRC := ${filter-out evloop/epoll.c evloop/kqueue.c evloop/uring.c, ${EVLOOP_SRC}}
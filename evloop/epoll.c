@@ -1,20 +1,72 @@
 #include <sys/epoll.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "evloop.h"
 
+#define EPOLL_INIT_SIZE 100
+
 static int m_epfd;
 
-static struct epoll_event m_evs[100];
-static uint8_t m_valid[100];
+static struct epoll_event *m_evs;
+static int m_evcap, m_nfds;
+
+/*
+ * Fdevs with pending readiness. Level triggered fdevs are only here
+ * between epoll_wait and the end of their dispatch. Edge triggered
+ * fdevs stay until they're disabled or report EAGAIN with fdev_again.
+ */
+static struct fdev **m_ready;
+static int m_rcap, m_nready;
+
+static int
+ready_add(struct fdev *ev)
+{
+    if (ev->index >= 0)
+        return 0;
+    if (m_nready == m_rcap) {
+        int ncap = m_rcap * 2;
+        struct fdev **nm_ready = realloc(m_ready, ncap * sizeof(*m_ready));
+        if (nm_ready == NULL)
+            return -1;
+        m_ready = nm_ready;
+        m_rcap = ncap;
+    }
+    ev->index = m_nready;
+    m_ready[m_nready] = ev;
+    m_nready++;
+    return 0;
+}
+
+static int
+evs_fit(void)
+{
+    if (m_nfds > m_evcap) {
+        int ncap = m_evcap * 2 > m_nfds ? m_evcap * 2 : m_nfds;
+        struct epoll_event *nm_evs = realloc(m_evs, ncap * sizeof(*m_evs));
+        if (nm_evs == NULL)
+            return -1;
+        m_evs = nm_evs;
+        m_evcap = ncap;
+    }
+    return 0;
+}
 
 int
 evloop_init(void)
 {
     if (timeheap_init() != 0)
         return -1;
+    m_evcap = EPOLL_INIT_SIZE;
+    if ((m_evs = calloc(m_evcap, sizeof(*m_evs))) == NULL)
+        return -1;
+    m_rcap = EPOLL_INIT_SIZE;
+    if ((m_ready = calloc(m_rcap, sizeof(*m_ready))) == NULL) {
+        free(m_evs);
+        return -1;
+    }
     m_epfd = epoll_create(getdtablesize());
     return m_epfd >= 0 ? 0 : -1;
 }
@@ -26,7 +78,18 @@ fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
     ev->cb = cb;
     ev->arg = arg;
     ev->flags = 0;
+    ev->ready = 0;
     ev->index = -1;
+    if (flags & EV_EDGE) {
+        struct epoll_event epev;
+        epev.data.ptr = ev;
+        epev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &epev) != 0)
+            return -1;
+        m_nfds++;
+        ev->flags = flags;
+        return 0;
+    }
     return fdev_enable(ev, flags);
 }
 
@@ -37,14 +100,18 @@ fdev_enable(struct fdev *ev, uint16_t flags)
     int err = 0;
     uint16_t sf = ev->flags;
     ev->flags |= flags;
+    if (ev->flags & EV_EDGE)
+        return (ev->ready & ev->flags) != 0 ? ready_add(ev) : 0;
     if (sf != ev->flags) {
         epev.data.ptr = ev;
         epev.events =
             ((ev->flags & EV_READ) ? EPOLLIN : 0) |
             ((ev->flags & EV_WRITE) ? EPOLLOUT : 0);
-        if (sf == 0)
+        if (sf == 0) {
             err = epoll_ctl(m_epfd, EPOLL_CTL_ADD, ev->fd, &epev);
-        else
+            if (err == 0)
+                m_nfds++;
+        } else
             err = epoll_ctl(m_epfd, EPOLL_CTL_MOD, ev->fd, &epev);
     }
     return err;
@@ -57,27 +124,75 @@ fdev_disable(struct fdev *ev, uint16_t flags)
     int err = 0;
     uint16_t sf = ev->flags;
     ev->flags &= ~flags;
+    if (ev->flags & EV_EDGE)
+        return 0;
     if (sf != ev->flags) {
         epev.data.ptr = ev;
         epev.events =
             ((ev->flags & EV_READ) ? EPOLLIN : 0) |
             ((ev->flags & EV_WRITE) ? EPOLLOUT : 0);
-        if (ev->flags == 0)
+        if (ev->flags == 0) {
             err = epoll_ctl(m_epfd, EPOLL_CTL_DEL, ev->fd, &epev);
-        else
+            if (err == 0)
+                m_nfds--;
+        } else
             err = epoll_ctl(m_epfd, EPOLL_CTL_MOD, ev->fd, &epev);
     }
     return err;
 }
 
+int
+fdev_again(struct fdev *ev, uint16_t flags)
+{
+    ev->ready &= ~flags;
+    return 0;
+}
+
 int
 fdev_del(struct fdev *ev)
 {
-    if (ev->index >= 0)
-        m_valid[ev->index] = 0;
+    if (ev->index >= 0) {
+        m_ready[ev->index] = NULL;
+        ev->index = -1;
+    }
+    if (ev->flags & EV_EDGE) {
+        struct epoll_event epev;
+        ev->flags = 0;
+        m_nfds--;
+        return epoll_ctl(m_epfd, EPOLL_CTL_DEL, ev->fd, &epev);
+    }
     return fdev_disable(ev, EV_READ|EV_WRITE);
 }
 
+static void
+ready_dispatch(void)
+{
+    int i, j, n = m_nready;
+    for (i = 0; i < n; i++) {
+        struct fdev *ev = m_ready[i];
+        if (ev == NULL)
+            continue;
+        if (ev->flags & ev->ready & EV_READ)
+            ev->cb(ev->fd, EV_READ, ev->arg);
+        if (m_ready[i] == ev && ev->flags & ev->ready & EV_WRITE)
+            ev->cb(ev->fd, EV_WRITE, ev->arg);
+    }
+    for (i = 0, j = 0; i < m_nready; i++) {
+        struct fdev *ev = m_ready[i];
+        if (ev == NULL)
+            continue;
+        if (!(ev->flags & EV_EDGE))
+            ev->ready = 0;
+        if (ev->flags & ev->ready & (EV_READ|EV_WRITE)) {
+            m_ready[j] = ev;
+            ev->index = j;
+            j++;
+        } else
+            ev->index = -1;
+    }
+    m_nready = j;
+}
+
 int
 evloop(void)
 {
@@ -86,33 +201,30 @@ evloop(void)
     while (1) {
         evtimers_run();
         delay = evtimer_delay();
-        if (delay.tv_sec >= 0)
+        if (m_nready > 0)
+            millisecs = 0;
+        else if (delay.tv_sec >= 0)
             millisecs = delay.tv_sec * 1000 + delay.tv_nsec / 1000000;
         else
             millisecs = -1;
 
-        if ((nev = epoll_wait(m_epfd, m_evs, 100, millisecs)) < 0) {
+        if (evs_fit() != 0)
+            return -1;
+        if ((nev = epoll_wait(m_epfd, m_evs, m_evcap, millisecs)) < 0) {
             if (errno == EINTR)
                 continue;
             else
                 return -1;
         }
-        memset(m_valid, 1, nev);
         for (i = 0; i < nev; i++) {
             struct fdev *ev = m_evs[i].data.ptr;
-            ev->index = i;
-        }
-        for (i = 0; i < nev; i++) {
-            struct fdev *ev = m_evs[i].data.ptr;
-            if ((m_valid[i] &&
-                    ev->flags & EV_READ &&
-                    m_evs[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)))
-                ev->cb(ev->fd, EV_READ, ev->arg);
-            if ((m_valid[i] && ev->flags & EV_WRITE &&
-                    m_evs[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP)))
-                ev->cb(ev->fd, EV_WRITE, ev->arg);
-            if (m_valid[i])
-                ev->index = -1;
+            if (m_evs[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP))
+                ev->ready |= EV_READ;
+            if (m_evs[i].events & (EPOLLOUT|EPOLLERR|EPOLLHUP))
+                ev->ready |= EV_WRITE;
+            if (ev->flags & ev->ready && ready_add(ev) != 0)
+                return -1;
         }
+        ready_dispatch();
     }
 }
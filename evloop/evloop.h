@@ -10,9 +10,16 @@
 #define EV_WRITE   2
 #define EV_TIMEOUT 3
 
+/*
+ * Only for fdev_new. Asks for edge triggered notification where the
+ * backend supports it. The owner must then report short reads and
+ * writes with fdev_again, or it will be called again right away.
+ */
+#define EV_EDGE    4
+
 typedef void (*evloop_cb_t)(int fd, short type, void *arg);
 
-#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE)
+#if defined(EVLOOP_EPOLL) || defined(EVLOOP_KQUEUE) || defined(EVLOOP_URING)
 
 struct fdev {
     evloop_cb_t cb;
@@ -21,6 +28,9 @@ struct fdev {
     uint16_t flags;
 #ifdef EVLOOP_EPOLL
     int16_t index;
+    uint16_t ready;
+#elif defined(EVLOOP_URING)
+    int slot;
 #else
     int16_t rdidx;
     int16_t wridx;
@@ -51,6 +61,7 @@ int fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb,
 int fdev_del(struct fdev *ev);
 int fdev_enable(struct fdev *ev, uint16_t flags);
 int fdev_disable(struct fdev *ev, uint16_t flags);
+int fdev_again(struct fdev *ev, uint16_t flags);
 
 void evtimer_init(struct timeout *, evloop_cb_t, void *);
 int evtimer_add(struct timeout *, struct timespec *);
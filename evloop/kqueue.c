@@ -31,7 +31,7 @@ fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
     ev->flags = 0;
     ev->rdidx = -1;
     ev->wridx = -1;
-    return fdev_enable(ev, flags);
+    return fdev_enable(ev, flags & (EV_READ|EV_WRITE));
 }
 
 int
@@ -76,6 +76,12 @@ fdev_disable(struct fdev *ev, uint16_t flags)
     return count > 0 ? kevent(m_kq, kp, count, NULL, 0, NULL) : 0;
 }
 
+int
+fdev_again(struct fdev *ev, uint16_t flags)
+{
+    return 0;
+}
+
 int
 fdev_del(struct fdev *ev)
 {
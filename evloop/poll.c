@@ -88,6 +88,12 @@ fdev_disable(struct fdev *ev, uint16_t flags)
     return 0;
 }
 
+int
+fdev_again(struct fdev *ev, uint16_t flags)
+{
+    return 0;
+}
+
 int
 fdev_del(struct fdev *ev)
 {
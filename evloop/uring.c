@@ -0,0 +1,491 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "evloop.h"
+
+#define URING_ENTRIES 1024
+#define URING_INIT_SLOTS 64
+
+/*
+ * Each fdev can have a poll and a poll removal completing at once, so
+ * the completion queue is kept at least twice as large as the number
+ * of slots. When the slots outgrow it, the ring is replaced by a
+ * larger one and all polls are armed again.
+ */
+#define URING_CQ_PER_SLOT 2
+
+/*
+ * Every fdev owns a slot. The user data of a poll request is the slot
+ * index combined with the slot generation at the time the poll was
+ * armed, so completions for polls that have since been removed, or
+ * for fdevs that have been deleted, can be recognized and dropped.
+ */
+#define URING_TOKEN(slot, gen) (((uint64_t)(gen) << 32) | (uint32_t)(slot))
+#define URING_TOKEN_SLOT(tok) ((int)((tok) & 0xffffffff))
+#define URING_TOKEN_GEN(tok) ((uint32_t)((tok) >> 32))
+#define URING_TOKEN_IGNORE UINT64_MAX
+
+struct uring_slot {
+    struct fdev *ev;
+    uint32_t gen;
+    uint16_t armed;
+    uint8_t dirty;
+    int next_free;
+};
+
+struct uring_ring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries, cq_entries;
+    unsigned sq_local_tail;
+};
+
+static struct uring_ring m_ring;
+static int m_cq_maxed;
+
+/*
+ * Completions taken off the ring before they can be dispatched, when
+ * the kernel needs room in the completion queue to accept more
+ * submissions.
+ */
+static struct io_uring_cqe *m_cqbuf;
+static unsigned m_ncqbuf, m_cqbufcap;
+
+static struct uring_slot *m_slots;
+static int *m_dirty;
+static int m_cap, m_ndirty, m_free = -1, m_used;
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags,
+    void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, m_ring.fd, to_submit, min_complete,
+        flags, arg, argsz);
+}
+
+static void
+uring_unmap(struct uring_ring *r)
+{
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_size);
+    close(r->fd);
+}
+
+static int
+uring_setup(struct uring_ring *r, unsigned cq_entries)
+{
+    struct io_uring_params params;
+
+    memset(r, 0, sizeof(*r));
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = cq_entries;
+    if ((r->fd = sys_io_uring_setup(URING_ENTRIES, &params)) < 0)
+        return -1;
+    if ((params.features & IORING_FEAT_EXT_ARG) == 0) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    r->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    r->cq_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size)
+            r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+    r->sq_entries = params.sq_entries;
+    r->sqes = mmap(NULL, r->sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd,
+        IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head = r->sq_ptr + params.sq_off.head;
+    r->sq_tail = r->sq_ptr + params.sq_off.tail;
+    r->sq_mask = r->sq_ptr + params.sq_off.ring_mask;
+    r->sq_array = r->sq_ptr + params.sq_off.array;
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = r->cq_ptr + params.cq_off.head;
+    r->cq_tail = r->cq_ptr + params.cq_off.tail;
+    r->cq_mask = r->cq_ptr + params.cq_off.ring_mask;
+    r->cqes = r->cq_ptr + params.cq_off.cqes;
+    r->cq_entries = params.cq_entries;
+    return 0;
+
+fail:
+    uring_unmap(r);
+    r->fd = -1;
+    return -1;
+}
+
+static int
+uring_grow(void)
+{
+    int ncap = m_cap * 2;
+    struct uring_slot *nm_slots = realloc(m_slots, ncap * sizeof(*m_slots));
+    int *nm_dirty = realloc(m_dirty, ncap * sizeof(*m_dirty));
+    if (nm_slots != NULL)
+        m_slots = nm_slots;
+    if (nm_dirty != NULL)
+        m_dirty = nm_dirty;
+    if (nm_slots == NULL || nm_dirty == NULL)
+        return errno;
+    memset(m_slots + m_cap, 0, (ncap - m_cap) * sizeof(*m_slots));
+    m_cap = ncap;
+    return 0;
+}
+
+static unsigned
+uring_sq_pending(void)
+{
+    return m_ring.sq_local_tail -
+        __atomic_load_n(m_ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Move the completions on the ring to m_cqbuf. They're dispatched
+ * from there by the loop, so this is safe to call from anywhere.
+ */
+static int
+uring_reap(void)
+{
+    unsigned head = *m_ring.cq_head;
+    unsigned tail = __atomic_load_n(m_ring.cq_tail, __ATOMIC_ACQUIRE);
+    if (m_ncqbuf + (tail - head) > m_cqbufcap) {
+        unsigned ncap = m_cqbufcap * 2;
+        while (ncap < m_ncqbuf + (tail - head))
+            ncap *= 2;
+        struct io_uring_cqe *nm_cqbuf =
+            realloc(m_cqbuf, ncap * sizeof(*m_cqbuf));
+        if (nm_cqbuf == NULL)
+            return -1;
+        m_cqbuf = nm_cqbuf;
+        m_cqbufcap = ncap;
+    }
+    for (; head != tail; head++) {
+        m_cqbuf[m_ncqbuf] = m_ring.cqes[head & *m_ring.cq_mask];
+        m_ncqbuf++;
+    }
+    __atomic_store_n(m_ring.cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * When the submission queue is full it's submitted right away. The
+ * kernel refuses with EBUSY while it holds completions that don't fit
+ * in the completion queue, so those are reaped before trying again.
+ */
+static struct io_uring_sqe *
+uring_get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    while (uring_sq_pending() == m_ring.sq_entries) {
+        __atomic_store_n(m_ring.sq_tail, m_ring.sq_local_tail,
+            __ATOMIC_RELEASE);
+        if (sys_io_uring_enter(uring_sq_pending(), 0, 0, NULL, 0) < 0) {
+            if (errno == EBUSY) {
+                if (uring_reap() != 0)
+                    return NULL;
+            } else if (errno != EINTR && errno != EAGAIN)
+                return NULL;
+        }
+    }
+    sqe = &m_ring.sqes[m_ring.sq_local_tail & *m_ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    m_ring.sq_array[m_ring.sq_local_tail & *m_ring.sq_mask] =
+        m_ring.sq_local_tail & *m_ring.sq_mask;
+    m_ring.sq_local_tail++;
+    return sqe;
+}
+
+static int
+uring_poll_add(int slot)
+{
+    struct uring_slot *s = &m_slots[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = s->ev->fd;
+    sqe->poll32_events =
+        ((s->armed & EV_READ) ? POLLIN : 0) |
+        ((s->armed & EV_WRITE) ? POLLOUT : 0);
+    sqe->user_data = URING_TOKEN(slot, s->gen);
+    return 0;
+}
+
+static int
+uring_poll_remove(int slot)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = URING_TOKEN(slot, m_slots[slot].gen);
+    sqe->user_data = URING_TOKEN_IGNORE;
+    return 0;
+}
+
+static void
+uring_mark(int slot)
+{
+    if (!m_slots[slot].dirty) {
+        m_slots[slot].dirty = 1;
+        m_dirty[m_ndirty] = slot;
+        m_ndirty++;
+    }
+}
+
+/*
+ * Turn the interest changes made since the last loop iteration into
+ * poll requests. Toggles that cancel each other out never reach the
+ * kernel and the rest are submitted together with the wait.
+ */
+static int
+uring_flush(void)
+{
+    for (int i = 0; i < m_ndirty; i++) {
+        int slot = m_dirty[i];
+        struct uring_slot *s = &m_slots[slot];
+        s->dirty = 0;
+        if (s->ev == NULL || s->armed == s->ev->flags)
+            continue;
+        if (s->armed != 0) {
+            if (uring_poll_remove(slot) != 0)
+                return -1;
+            s->gen++;
+        }
+        s->armed = s->ev->flags;
+        if (s->armed != 0 && uring_poll_add(slot) != 0)
+            return -1;
+    }
+    m_ndirty = 0;
+    __atomic_store_n(m_ring.sq_tail, m_ring.sq_local_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Replace the ring with one whose completion queue fits the slots.
+ * Closing the old ring cancels its polls, so every armed slot gets a
+ * new generation and is armed again on the new ring. Completions
+ * already reaped from the old ring are dropped by the generation
+ * check. If the ring can't grow, the old one is kept and the loop
+ * relies on reaping when the kernel reports EBUSY.
+ */
+static void
+uring_resize(void)
+{
+    struct uring_ring nr;
+    unsigned want = m_ring.cq_entries;
+    while (want < URING_CQ_PER_SLOT * m_used)
+        want *= 2;
+    if (uring_setup(&nr, want) != 0) {
+        m_cq_maxed = 1;
+        return;
+    }
+    if (nr.cq_entries <= m_ring.cq_entries) {
+        uring_unmap(&nr);
+        m_cq_maxed = 1;
+        return;
+    }
+    uring_unmap(&m_ring);
+    m_ring = nr;
+    for (int slot = 0; slot < m_used; slot++) {
+        struct uring_slot *s = &m_slots[slot];
+        s->gen++;
+        if (s->armed != 0) {
+            s->armed = 0;
+            if (s->ev != NULL)
+                uring_mark(slot);
+        }
+    }
+}
+
+int
+evloop_init(void)
+{
+    if (timeheap_init() != 0)
+        return -1;
+    if (uring_setup(&m_ring, URING_CQ_PER_SLOT * URING_ENTRIES) != 0)
+        return -1;
+
+    m_cqbufcap = URING_ENTRIES;
+    if ((m_cqbuf = calloc(m_cqbufcap, sizeof(*m_cqbuf))) == NULL)
+        return -1;
+    m_cap = URING_INIT_SLOTS;
+    if ((m_slots = calloc(m_cap, sizeof(*m_slots))) == NULL)
+        return -1;
+    if ((m_dirty = calloc(m_cap, sizeof(*m_dirty))) == NULL) {
+        free(m_slots);
+        return -1;
+    }
+    return 0;
+}
+
+int
+fdev_new(struct fdev *ev, int fd, uint16_t flags, evloop_cb_t cb, void *arg)
+{
+    int slot;
+    if (m_free >= 0) {
+        slot = m_free;
+        m_free = m_slots[slot].next_free;
+    } else {
+        if (m_used == m_cap && uring_grow() != 0)
+            return errno;
+        slot = m_used;
+        m_used++;
+    }
+    m_slots[slot].ev = ev;
+    m_slots[slot].armed = 0;
+    ev->fd = fd;
+    ev->cb = cb;
+    ev->arg = arg;
+    ev->flags = 0;
+    ev->slot = slot;
+    return fdev_enable(ev, flags & (EV_READ|EV_WRITE));
+}
+
+int
+fdev_enable(struct fdev *ev, uint16_t flags)
+{
+    uint16_t sf = ev->flags;
+    ev->flags |= flags;
+    if (sf != ev->flags)
+        uring_mark(ev->slot);
+    return 0;
+}
+
+int
+fdev_disable(struct fdev *ev, uint16_t flags)
+{
+    uint16_t sf = ev->flags;
+    ev->flags &= ~flags;
+    if (sf != ev->flags)
+        uring_mark(ev->slot);
+    return 0;
+}
+
+int
+fdev_again(struct fdev *ev, uint16_t flags)
+{
+    return 0;
+}
+
+int
+fdev_del(struct fdev *ev)
+{
+    int err = 0;
+    struct uring_slot *s = &m_slots[ev->slot];
+    if (s->armed != 0)
+        err = uring_poll_remove(ev->slot);
+    s->gen++;
+    s->ev = NULL;
+    s->armed = 0;
+    s->next_free = m_free;
+    m_free = ev->slot;
+    ev->flags = 0;
+    return err;
+}
+
+static void
+uring_dispatch(struct io_uring_cqe *cqe)
+{
+    struct uring_slot *s;
+    struct fdev *ev;
+    int slot = URING_TOKEN_SLOT(cqe->user_data);
+    uint32_t gen = URING_TOKEN_GEN(cqe->user_data);
+
+    if (cqe->user_data == URING_TOKEN_IGNORE)
+        return;
+    s = &m_slots[slot];
+    if (s->ev == NULL || s->gen != gen)
+        return;
+
+    ev = s->ev;
+    s->armed = 0;
+    uring_mark(slot);
+    if (cqe->res < 0)
+        return;
+    if (ev->flags & EV_READ && cqe->res & (POLLIN|POLLERR|POLLHUP))
+        ev->cb(ev->fd, EV_READ, ev->arg);
+    if ((s->ev == ev && s->gen == gen && ev->flags & EV_WRITE &&
+            cqe->res & (POLLOUT|POLLERR|POLLHUP)))
+        ev->cb(ev->fd, EV_WRITE, ev->arg);
+}
+
+int
+evloop(void)
+{
+    struct timespec delay;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    while (1) {
+        evtimers_run();
+        delay = evtimer_delay();
+
+        if (!m_cq_maxed && m_ring.cq_entries < URING_CQ_PER_SLOT * m_used)
+            uring_resize();
+        if (uring_flush() != 0)
+            return -1;
+
+        memset(&arg, 0, sizeof(arg));
+        if (delay.tv_sec >= 0) {
+            ts.tv_sec = delay.tv_sec;
+            ts.tv_nsec = delay.tv_nsec;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        /* Don't wait if completions were reaped while submitting. */
+        if (sys_io_uring_enter(uring_sq_pending(), m_ncqbuf > 0 ? 0 : 1,
+                IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg)) < 0) {
+            if (errno != EINTR && errno != ETIME && errno != EBUSY)
+                return -1;
+        }
+
+        if (uring_reap() != 0)
+            return -1;
+        for (unsigned i = 0; i < m_ncqbuf; i++) {
+            struct io_uring_cqe cqe = m_cqbuf[i];
+            uring_dispatch(&cqe);
+        }
+        m_ncqbuf = 0;
+    }
+}
@@ -298,6 +298,20 @@ btpd_del(struct ipc *ipc, struct ipc_torrent *tp)
     return simple_treq(ipc, "del", tp);
 }
 
+enum ipc_err
+btpd_prio(struct ipc *ipc, struct ipc_torrent *tp, unsigned file,
+    enum ipc_fprio prio)
+{
+    struct iobuf iob = iobuf_init(48);
+    if (tp->by_hash) {
+        iobuf_swrite(&iob, "l4:prio20:");
+        iobuf_write(&iob, tp->u.hash, 20);
+        iobuf_print(&iob, "i%uei%dee", file, prio);
+    } else
+        iobuf_print(&iob, "l4:prioi%uei%uei%dee", tp->u.num, file, prio);
+    return ipc_buf_req_code(ipc, &iob);
+}
+
 enum ipc_err
 btpd_rate(struct ipc *ipc, unsigned up, unsigned down)
 {
@@ -333,3 +347,16 @@ btpd_stop_all(struct ipc *ipc)
     iobuf_swrite(&iob, "l8:stop-alle");
     return ipc_buf_req_code(ipc, &iob);
 }
+
+enum ipc_err
+btpd_stream(struct ipc *ipc, struct ipc_torrent *tp, int on)
+{
+    struct iobuf iob = iobuf_init(48);
+    if (tp->by_hash) {
+        iobuf_swrite(&iob, "l6:stream20:");
+        iobuf_write(&iob, tp->u.hash, 20);
+        iobuf_print(&iob, "i%dee", on);
+    } else
+        iobuf_print(&iob, "l6:streami%uei%dee", tp->u.num, on);
+    return ipc_buf_req_code(ipc, &iob);
+}
@@ -41,6 +41,12 @@ enum ipc_tstate {
     IPC_TSTATE_SEED
 };
 
+enum ipc_fprio {
+    IPC_FPRIO_SKIP,
+    IPC_FPRIO_NORMAL,
+    IPC_FPRIO_HIGH
+};
+
 #ifndef DAEMON
 
 struct ipc;
@@ -77,11 +83,14 @@ const char *ipc_strerror(enum ipc_err err);
 enum ipc_err btpd_add(struct ipc *ipc, const char *mi, size_t mi_size,
     const char *content, const char *name, const char *label);
 enum ipc_err btpd_del(struct ipc *ipc, struct ipc_torrent *tp);
+enum ipc_err btpd_prio(struct ipc *ipc, struct ipc_torrent *tp, unsigned file,
+    enum ipc_fprio prio);
 enum ipc_err btpd_rate(struct ipc *ipc, unsigned up, unsigned down);
 enum ipc_err btpd_start(struct ipc *ipc, struct ipc_torrent *tp);
 enum ipc_err btpd_start_all(struct ipc *ipc);
 enum ipc_err btpd_stop(struct ipc *ipc, struct ipc_torrent *tp);
 enum ipc_err btpd_stop_all(struct ipc *ipc);
+enum ipc_err btpd_stream(struct ipc *ipc, struct ipc_torrent *tp, int on);
 enum ipc_err btpd_die(struct ipc *ipc);
 enum ipc_err btpd_get(struct ipc *ipc, enum ipc_dval *keys, size_t nkeys,
     tget_cb_t cb, void *arg);
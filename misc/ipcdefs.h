@@ -15,6 +15,7 @@ ERRDEF(ESHUTDOWN,       "btpd is shutting down")
 ERRDEF(ETACTIVE,        "torrent is active")
 ERRDEF(ETENTEXIST,      "torrent entry exists")
 ERRDEF(ETINACTIVE,      "torrent is inactive")
+ERRDEF(ENOFILE,         "no such file")
 #ifdef __IPCE
 #undef __IPCE
 #undef ERRDEF
@@ -43,6 +44,11 @@ TVDEF(TOTUP,    NUM,            "total_up")
 TVDEF(TRERR,    NUM,            "tr_errors")
 TVDEF(TRGOOD,   NUM,            "tr_good")
 TVDEF(LABEL,    STR,            "label")
+TVDEF(REQDEPTH, NUM,            "req_depth")
+TVDEF(REQTMO,   NUM,            "req_timeouts")
+TVDEF(REQREAS,  NUM,            "req_reassigned")
+TVDEF(EGDUP,    NUM,            "eg_dup_bytes")
+TVDEF(TESTQ,    NUM,            "test_queue")
 #ifdef __IPCTV
 #undef __IPCTV
 #undef TVDEF
@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_X86
+#endif
+
+#include "subr.h"
+#include "sha1.h"
+
+/*
+ * Single messages are hashed with OpenSSL, which already picks the
+ * best code for the cpu. The functions here are for hashing several
+ * messages of equal length, such as the pieces of a torrent, at once.
+ * A backend hashes blocks of up to SHA1_MAXLANES messages and is
+ * chosen by sha1_init from what the cpu supports:
+ *
+ * sha-ni: The SHA extensions, two messages interleaved so that the
+ *         rounds of one run while the other waits on its result.
+ * avx2:   Eight messages, one in each 32 bit lane of the registers.
+ * c:      Plain C, one message after the other.
+ */
+
+struct sha1_backend {
+    const char *name;
+    unsigned lanes;
+    void (*blocks)(uint32_t h[5][SHA1_MAXLANES], const uint8_t *data[],
+        unsigned n, size_t nblocks);
+};
+
+#define rol(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_blocks_c(uint32_t h[5][SHA1_MAXLANES], const uint8_t *data[],
+    unsigned n, size_t nblocks)
+{
+    uint32_t w[16], a, b, c, d, e, f, k, t;
+    for (unsigned l = 0; l < n; l++) {
+        const uint8_t *p = data[l];
+        for (size_t blk = 0; blk < nblocks; blk++, p += 64) {
+            a = h[0][l]; b = h[1][l]; c = h[2][l]; d = h[3][l]; e = h[4][l];
+            for (int i = 0; i < 80; i++) {
+                if (i < 16)
+                    w[i] = dec_be32(p + 4 * i);
+                else
+                    w[i & 15] = rol(w[(i - 3) & 15] ^ w[(i - 8) & 15]
+                        ^ w[(i - 14) & 15] ^ w[i & 15], 1);
+                if (i < 20) {
+                    f = d ^ (b & (c ^ d));
+                    k = 0x5a827999;
+                } else if (i < 40) {
+                    f = b ^ c ^ d;
+                    k = 0x6ed9eba1;
+                } else if (i < 60) {
+                    f = (b & c) | (d & (b | c));
+                    k = 0x8f1bbcdc;
+                } else {
+                    f = b ^ c ^ d;
+                    k = 0xca62c1d6;
+                }
+                t = rol(a, 5) + f + e + k + w[i & 15];
+                e = d; d = c; c = rol(b, 30); b = a; a = t;
+            }
+            h[0][l] += a; h[1][l] += b; h[2][l] += c; h[3][l] += d;
+            h[4][l] += e;
+        }
+    }
+}
+
+#ifdef SHA1_X86
+
+/*
+ * Four rounds on both lanes. The message words are computed as in
+ * Intel's description of the SHA extensions, in the four registers
+ * m[][g % 4].
+ */
+#define NI_LANE(l, g) do {                                              \
+    if ((g) < 4)                                                        \
+        m[l][g] = _mm_shuffle_epi8(_mm_loadu_si128(                     \
+            (const __m128i *)(p[l] + 16 * (g))), bswap);                \
+    if ((g) == 0)                                                       \
+        e[l][0] = _mm_add_epi32(e[l][0], m[l][0]);                      \
+    else                                                                \
+        e[l][(g) & 1] = _mm_sha1nexte_epu32(e[l][(g) & 1], m[l][(g) % 4]); \
+    e[l][((g) + 1) & 1] = abcd[l];                                      \
+    if ((g) >= 3 && (g) <= 18)                                          \
+        m[l][((g) + 1) % 4] =                                           \
+            _mm_sha1msg2_epu32(m[l][((g) + 1) % 4], m[l][(g) % 4]);     \
+    abcd[l] = _mm_sha1rnds4_epu32(abcd[l], e[l][(g) & 1], (g) / 5);     \
+    if ((g) >= 1 && (g) <= 16)                                          \
+        m[l][((g) + 3) % 4] =                                           \
+            _mm_sha1msg1_epu32(m[l][((g) + 3) % 4], m[l][(g) % 4]);     \
+    if ((g) >= 2 && (g) <= 17)                                          \
+        m[l][((g) + 2) % 4] =                                           \
+            _mm_xor_si128(m[l][((g) + 2) % 4], m[l][(g) % 4]);          \
+} while (0)
+
+#define NI_ROUNDS(g) do { NI_LANE(0, g); NI_LANE(1, g); } while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void
+sha1_blocks_ni(uint32_t h[5][SHA1_MAXLANES], const uint8_t *data[],
+    unsigned n, size_t nblocks)
+{
+    const __m128i bswap =
+        _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd[2], abcd0[2], e[2][2], e0[2], m[2][4];
+    const uint8_t *p[2];
+
+    for (unsigned j = 0; j < n; j += 2) {
+        unsigned lane[2] = { j, j + 1 < n ? j + 1 : j };
+        for (int l = 0; l < 2; l++) {
+            abcd[l] = _mm_set_epi32(h[0][lane[l]], h[1][lane[l]],
+                h[2][lane[l]], h[3][lane[l]]);
+            e[l][0] = _mm_set_epi32(h[4][lane[l]], 0, 0, 0);
+            p[l] = data[lane[l]];
+        }
+        for (size_t blk = 0; blk < nblocks; blk++) {
+            abcd0[0] = abcd[0]; e0[0] = e[0][0];
+            abcd0[1] = abcd[1]; e0[1] = e[1][0];
+            NI_ROUNDS(0); NI_ROUNDS(1); NI_ROUNDS(2); NI_ROUNDS(3);
+            NI_ROUNDS(4); NI_ROUNDS(5); NI_ROUNDS(6); NI_ROUNDS(7);
+            NI_ROUNDS(8); NI_ROUNDS(9); NI_ROUNDS(10); NI_ROUNDS(11);
+            NI_ROUNDS(12); NI_ROUNDS(13); NI_ROUNDS(14); NI_ROUNDS(15);
+            NI_ROUNDS(16); NI_ROUNDS(17); NI_ROUNDS(18); NI_ROUNDS(19);
+            e[0][0] = _mm_sha1nexte_epu32(e[0][0], e0[0]);
+            e[1][0] = _mm_sha1nexte_epu32(e[1][0], e0[1]);
+            abcd[0] = _mm_add_epi32(abcd[0], abcd0[0]);
+            abcd[1] = _mm_add_epi32(abcd[1], abcd0[1]);
+            p[0] += 64;
+            p[1] += 64;
+        }
+        for (int l = 0; l < 2; l++) {
+            h[0][lane[l]] = _mm_extract_epi32(abcd[l], 3);
+            h[1][lane[l]] = _mm_extract_epi32(abcd[l], 2);
+            h[2][lane[l]] = _mm_extract_epi32(abcd[l], 1);
+            h[3][lane[l]] = _mm_extract_epi32(abcd[l], 0);
+            h[4][lane[l]] = _mm_extract_epi32(e[l][0], 3);
+        }
+    }
+}
+
+#define AVX_ROL(x, n) \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+/*
+ * Eight words of each lane are loaded and transposed, so that each
+ * register holds the same word of all lanes.
+ */
+__attribute__((target("avx2")))
+static void
+avx_load(__m256i *w, const uint8_t *p[SHA1_MAXLANES], size_t off)
+{
+    const __m256i bswap = _mm256_setr_epi8(
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i r[8], t[8], u[8];
+    for (int i = 0; i < 8; i++)
+        r[i] = _mm256_loadu_si256((const __m256i *)(p[i] + off));
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        w[i] = _mm256_shuffle_epi8(
+            _mm256_permute2x128_si256(u[i], u[i + 4], 0x20), bswap);
+        w[i + 4] = _mm256_shuffle_epi8(
+            _mm256_permute2x128_si256(u[i], u[i + 4], 0x31), bswap);
+    }
+}
+
+__attribute__((target("avx2")))
+static void
+sha1_blocks_avx2(uint32_t h[5][SHA1_MAXLANES], const uint8_t *data[],
+    unsigned n, size_t nblocks)
+{
+    __m256i w[16], a, b, c, d, e, a0, b0, c0, d0, e0, f, k, t;
+    const uint8_t *p[SHA1_MAXLANES];
+
+    for (unsigned l = 0; l < SHA1_MAXLANES; l++)
+        p[l] = data[l < n ? l : 0];
+    a = _mm256_loadu_si256((__m256i *)h[0]);
+    b = _mm256_loadu_si256((__m256i *)h[1]);
+    c = _mm256_loadu_si256((__m256i *)h[2]);
+    d = _mm256_loadu_si256((__m256i *)h[3]);
+    e = _mm256_loadu_si256((__m256i *)h[4]);
+    for (size_t off = 0; off < nblocks * 64; off += 64) {
+        a0 = a; b0 = b; c0 = c; d0 = d; e0 = e;
+        avx_load(w, p, off);
+        avx_load(w + 8, p, off + 32);
+        for (int i = 0; i < 80; i++) {
+            if (i >= 16)
+                w[i & 15] = AVX_ROL(_mm256_xor_si256(
+                    _mm256_xor_si256(w[(i - 3) & 15], w[(i - 8) & 15]),
+                    _mm256_xor_si256(w[(i - 14) & 15], w[i & 15])), 1);
+            if (i < 20) {
+                f = _mm256_xor_si256(d,
+                    _mm256_and_si256(b, _mm256_xor_si256(c, d)));
+                k = _mm256_set1_epi32(0x5a827999);
+            } else if (i < 40) {
+                f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+                k = _mm256_set1_epi32(0x6ed9eba1);
+            } else if (i < 60) {
+                f = _mm256_or_si256(_mm256_and_si256(b, c),
+                    _mm256_and_si256(d, _mm256_or_si256(b, c)));
+                k = _mm256_set1_epi32(0x8f1bbcdc);
+            } else {
+                f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+                k = _mm256_set1_epi32(0xca62c1d6);
+            }
+            t = _mm256_add_epi32(_mm256_add_epi32(AVX_ROL(a, 5), f),
+                _mm256_add_epi32(_mm256_add_epi32(e, k), w[i & 15]));
+            e = d; d = c; c = AVX_ROL(b, 30); b = a; a = t;
+        }
+        a = _mm256_add_epi32(a, a0);
+        b = _mm256_add_epi32(b, b0);
+        c = _mm256_add_epi32(c, c0);
+        d = _mm256_add_epi32(d, d0);
+        e = _mm256_add_epi32(e, e0);
+    }
+    _mm256_storeu_si256((__m256i *)h[0], a);
+    _mm256_storeu_si256((__m256i *)h[1], b);
+    _mm256_storeu_si256((__m256i *)h[2], c);
+    _mm256_storeu_si256((__m256i *)h[3], d);
+    _mm256_storeu_si256((__m256i *)h[4], e);
+}
+
+#endif /* SHA1_X86 */
+
+static const struct sha1_backend m_sha1_c = { "c", 1, sha1_blocks_c };
+#ifdef SHA1_X86
+static const struct sha1_backend m_sha1_ni = { "sha-ni", 2, sha1_blocks_ni };
+static const struct sha1_backend m_sha1_avx2 =
+    { "avx2", 8, sha1_blocks_avx2 };
+#endif
+
+static const struct sha1_backend *m_sha1 = &m_sha1_c;
+
+void
+sha1_init(void)
+{
+#ifdef SHA1_X86
+    unsigned eax, ebx, ecx, edx;
+    __builtin_cpu_init();
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA)
+            && __builtin_cpu_supports("sse4.1"))
+        m_sha1 = &m_sha1_ni;
+    else if (__builtin_cpu_supports("avx2"))
+        m_sha1 = &m_sha1_avx2;
+#endif
+}
+
+const char *
+sha1_backend(void)
+{
+    return m_sha1->name;
+}
+
+/*
+ * The number of messages the backend hashes at once. Hashing fewer
+ * than this together takes as long as hashing this many.
+ */
+unsigned
+sha1_lanes(void)
+{
+    return m_sha1->lanes;
+}
+
+void
+sha1_mb_init(struct sha1_mb *mb, unsigned n)
+{
+    static const uint32_t iv[5] =
+        { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    mb->n = n;
+    mb->len = 0;
+    for (int i = 0; i < 5; i++)
+        for (int l = 0; l < SHA1_MAXLANES; l++)
+            mb->h[i][l] = iv[i];
+}
+
+/*
+ * Hash the next len bytes of each message. The length must be a
+ * multiple of 64 bytes.
+ */
+void
+sha1_mb_update(struct sha1_mb *mb, const uint8_t *data[], size_t len)
+{
+    m_sha1->blocks(mb->h, data, mb->n, len / 64);
+    mb->len += len;
+}
+
+/*
+ * Hash the last len bytes of each message and put the 20 byte hashes
+ * after each other in hashes.
+ */
+void
+sha1_mb_final(struct sha1_mb *mb, const uint8_t *data[], size_t len,
+    uint8_t *hashes)
+{
+    uint8_t tail[SHA1_MAXLANES][128];
+    const uint8_t *tp[SHA1_MAXLANES];
+    size_t full = len - len % 64, rest = len % 64;
+    size_t tlen = rest < 56 ? 64 : 128;
+    uint64_t bits = (mb->len + len) * 8;
+
+    m_sha1->blocks(mb->h, data, mb->n, full / 64);
+    for (unsigned l = 0; l < mb->n; l++) {
+        memcpy(tail[l], data[l] + full, rest);
+        tail[l][rest] = 0x80;
+        memset(tail[l] + rest + 1, 0, tlen - rest - 9);
+        enc_be64(tail[l] + tlen - 8, bits);
+        tp[l] = tail[l];
+    }
+    m_sha1->blocks(mb->h, tp, mb->n, tlen / 64);
+    for (unsigned l = 0; l < mb->n; l++)
+        for (int i = 0; i < 5; i++)
+            enc_be32(hashes + 20 * l + 4 * i, mb->h[i][l]);
+}
+
+void
+sha1_mb_hash(const uint8_t *data[], unsigned n, size_t len, uint8_t *hashes)
+{
+    struct sha1_mb mb;
+    sha1_mb_init(&mb, n);
+    sha1_mb_final(&mb, data, len, hashes);
+}
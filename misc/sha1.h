@@ -0,0 +1,27 @@
+#ifndef BTPD_SHA1_H
+#define BTPD_SHA1_H
+
+#define SHA1_MAXLANES 8
+
+/*
+ * State for hashing up to SHA1_MAXLANES messages of equal length at
+ * once. The words of the lanes are kept side by side.
+ */
+struct sha1_mb {
+    unsigned n;
+    uint64_t len;
+    uint32_t h[5][SHA1_MAXLANES];
+};
+
+void sha1_init(void);
+const char *sha1_backend(void);
+unsigned sha1_lanes(void);
+
+void sha1_mb_init(struct sha1_mb *mb, unsigned n);
+void sha1_mb_update(struct sha1_mb *mb, const uint8_t *data[], size_t len);
+void sha1_mb_final(struct sha1_mb *mb, const uint8_t *data[], size_t len,
+    uint8_t *hashes);
+void sha1_mb_hash(const uint8_t *data[], unsigned n, size_t len,
+    uint8_t *hashes);
+
+#endif
@@ -1,3 +1,7 @@
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -8,6 +12,7 @@
 #include <openssl/sha.h>
 
 #include "metainfo.h"
+#include "sha1.h"
 #include "subr.h"
 #include "stream.h"
 
@@ -24,6 +29,7 @@ bts_open(struct bt_stream **res, unsigned nfiles, struct mi_file *files,
     bts->fd_cb = fd_cb;
     bts->fd_arg = fd_arg;
     bts->fd = -1;
+    bts->nullfd = -1;
 
     for (unsigned i = 0; i < bts->nfiles; i++)
         bts->totlen += bts->files[i].length;
@@ -38,6 +44,10 @@ bts_close(struct bt_stream *bts)
     int err = 0;
     if (bts->fd != -1 && close(bts->fd) == -1)
         err = errno;
+    if (bts->nullfd != -1)
+        close(bts->nullfd);
+    free(bts->shabuf);
+    free(bts->mbbuf);
     free(bts);
     return err;
 }
@@ -69,6 +79,24 @@ bts_seek(struct bt_stream *bts, off_t off)
     return 0;
 }
 
+static int
+bts_open_fd(struct bt_stream *bts)
+{
+    int err;
+    while (bts->files[bts->index].length == 0)
+        bts->index++;
+    if ((err = bts->fd_cb(bts->files[bts->index].path,
+             &bts->fd, bts->fd_arg)) != 0)
+        return err;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (bts->sequential)
+        posix_fadvise(bts->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    if (bts->f_off != 0)
+        lseek(bts->fd, bts->f_off, SEEK_SET);
+    return 0;
+}
+
 int
 bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len)
 {
@@ -82,16 +110,8 @@ bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len)
 
     boff = 0;
     while (boff < len) {
-        if (bts->fd == -1) {
-            while (bts->files[bts->index].length == 0)
-                bts->index++;
-            err = bts->fd_cb(bts->files[bts->index].path,
-                &bts->fd, bts->fd_arg);
-            if (err != 0)
-                return err;
-            if (bts->f_off != 0)
-                lseek(bts->fd, bts->f_off, SEEK_SET);
-        }
+        if (bts->fd == -1 && (err = bts_open_fd(bts)) != 0)
+            return err;
 
         wantread = min(len - boff, bts->files[bts->index].length - bts->f_off);
         didread = read(bts->fd, buf + boff, wantread);
@@ -126,16 +146,8 @@ bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len)
 
     boff = 0;
     while (boff < len) {
-        if (bts->fd == -1) {
-            while (bts->files[bts->index].length == 0)
-                bts->index++;
-            err = bts->fd_cb(bts->files[bts->index].path,
-                &bts->fd, bts->fd_arg);
-            if (err != 0)
-                return err;
-            if (bts->f_off != 0)
-                lseek(bts->fd, bts->f_off, SEEK_SET);
-        }
+        if (bts->fd == -1 && (err = bts_open_fd(bts)) != 0)
+            return err;
 
         wantwrite = min(len - boff, bts->files[bts->index].length - bts->f_off);
         didwrite = write(bts->fd, buf + boff, wantwrite);
@@ -156,29 +168,190 @@ bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len)
     return 0;
 }
 
-#define SHAFILEBUF (1 << 15)
+/*
+ * Send up to len bytes, starting at off, from the stream to the socket
+ * sd without copying them through user space. At most the rest of the
+ * file containing off is sent in one call, so *sent may be less than
+ * len. Returns ENOSYS where the system lacks a suitable primitive.
+ */
+int
+bts_send(struct bt_stream *bts, off_t off, size_t len, int sd, size_t *sent)
+{
+#ifdef __linux__
+    size_t wantsend;
+    ssize_t didsend;
+    int err;
+
+    assert(off + len <= bts->totlen);
+    if ((err = bts_seek(bts, off)) != 0)
+        return err;
+
+    if (bts->fd == -1 && (err = bts_open_fd(bts)) != 0)
+        return err;
+
+    wantsend = min(len, bts->files[bts->index].length - bts->f_off);
+    didsend = sendfile(sd, bts->fd, NULL, wantsend);
+    if (didsend == -1)
+        return errno;
+    else if (didsend == 0)
+        return ENOENT;
+
+    bts->f_off += didsend;
+    bts->t_off += didsend;
+    if (bts->f_off == bts->files[bts->index].length) {
+        close(bts->fd);
+        bts->fd = -1;
+        bts->f_off = 0;
+        bts->index++;
+    }
+    *sent = didsend;
+    return 0;
+#else
+    return ENOSYS;
+#endif
+}
+
+/*
+ * Tell the system that the data starting at off will be read soon.
+ * Like bts_send, only the part in the file containing off is covered.
+ */
+int
+bts_prefetch(struct bt_stream *bts, off_t off, size_t len)
+{
+    int err;
+
+    assert(off + len <= bts->totlen);
+    if ((err = bts_seek(bts, off)) != 0)
+        return err;
+    if (bts->fd == -1 && (err = bts_open_fd(bts)) != 0)
+        return err;
+#ifdef POSIX_FADV_WILLNEED
+    return posix_fadvise(bts->fd, bts->f_off,
+        min(len, bts->files[bts->index].length - bts->f_off),
+        POSIX_FADV_WILLNEED);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Tell the system that the stream's files will be read from start to
+ * end, so it can read further ahead.
+ */
+void
+bts_sequential(struct bt_stream *bts)
+{
+    bts->sequential = 1;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (bts->fd != -1)
+        posix_fadvise(bts->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+/*
+ * The data is read in large chunks, into a buffer kept with the stream.
+ */
+#define SHAFILEBUF (1 << 20)
 
 int
 bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash)
 {
     SHA_CTX ctx;
-    char buf[SHAFILEBUF];
     size_t wantread;
     int err = 0;
 
+    if (bts->shabuf == NULL && (bts->shabuf = malloc(SHAFILEBUF)) == NULL)
+        return ENOMEM;
+
     SHA1_Init(&ctx);
     while (length > 0) {
         wantread = min(length, SHAFILEBUF);
-        if ((err = bts_get(bts, start, buf, wantread)) != 0)
+        if ((err = bts_get(bts, start, bts->shabuf, wantread)) != 0)
             break;
         length -= wantread;
         start += wantread;
-        SHA1_Update(&ctx, buf, wantread);
+        SHA1_Update(&ctx, bts->shabuf, wantread);
     }
     SHA1_Final(hash, &ctx);
     return err;
 }
 
+/*
+ * Read the data starting at off into the page cache, so that bts_send
+ * won't have to wait for the disk. On Linux the data is sent to
+ * /dev/null, which doesn't copy it to user space.
+ */
+int
+bts_warm(struct bt_stream *bts, off_t off, size_t len)
+{
+    size_t wantread;
+    int err = 0;
+
+#ifdef __linux__
+    size_t sent;
+    if (bts->nullfd == -1
+            && (bts->nullfd = open("/dev/null", O_WRONLY)) == -1)
+        return errno;
+    while (len > 0
+            && (err = bts_send(bts, off, len, bts->nullfd, &sent)) == 0) {
+        off += sent;
+        len -= sent;
+    }
+    if (err != EINVAL)
+        return err;
+#endif
+    if (bts->shabuf == NULL && (bts->shabuf = malloc(SHAFILEBUF)) == NULL)
+        return ENOMEM;
+    while (len > 0) {
+        wantread = min(len, SHAFILEBUF);
+        if ((err = bts_get(bts, off, bts->shabuf, wantread)) != 0)
+            return err;
+        off += wantread;
+        len -= wantread;
+    }
+    return 0;
+}
+
+/*
+ * The pieces hashed side by side are read in one go, into a buffer of
+ * up to SHAMBBUF bytes kept with the stream.
+ */
+#define SHAMBBUF (16 << 20)
+
+/*
+ * Hash the n pieces of length plen that follow each other from start.
+ * They're read in a single sequential pass, as many pieces at a time
+ * as fit in SHAMBBUF, and the pieces of each read are hashed at once.
+ * Pieces too large to be grouped are hashed one at a time.
+ */
+int
+bts_sha_mb(struct bt_stream *bts, off_t start, off_t plen, unsigned n,
+    uint8_t *hashes)
+{
+    const uint8_t *data[SHA1_MAXLANES];
+    unsigned group = min(n, SHAMBBUF / plen), g;
+    int err = 0;
+
+    assert(n > 0 && n <= SHA1_MAXLANES);
+    if (group < 2) {
+        for (unsigned i = 0; i < n && err == 0; i++)
+            err = bts_sha(bts, start + i * plen, plen, hashes + i * 20);
+        return err;
+    }
+    if (bts->mbbuf == NULL && (bts->mbbuf = malloc(SHAMBBUF)) == NULL)
+        return ENOMEM;
+
+    for (unsigned i = 0; i < n; i += g) {
+        g = min(n - i, group);
+        if ((err = bts_get(bts, start + i * plen, bts->mbbuf, g * plen)) != 0)
+            return err;
+        for (unsigned j = 0; j < g; j++)
+            data[j] = bts->mbbuf + j * plen;
+        sha1_mb_hash(data, g, plen, hashes + i * 20);
+    }
+    return 0;
+}
+
 const char *
 bts_filename(struct bt_stream *bts)
 {
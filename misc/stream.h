@@ -14,6 +14,10 @@ struct bt_stream {
     off_t t_off;
     off_t f_off;
     int fd;
+    int sequential;
+    int nullfd;
+    uint8_t *shabuf;
+    uint8_t *mbbuf;
 };
 
 int bts_open(struct bt_stream **res, unsigned nfiles, struct mi_file *files,
@@ -21,7 +25,14 @@ int bts_open(struct bt_stream **res, unsigned nfiles, struct mi_file *files,
 int bts_close(struct bt_stream *bts);
 int bts_get(struct bt_stream *bts, off_t off, uint8_t *buf, size_t len);
 int bts_put(struct bt_stream *bts, off_t off, const uint8_t *buf, size_t len);
+int bts_send(struct bt_stream *bts, off_t off, size_t len, int sd,
+    size_t *sent);
+int bts_warm(struct bt_stream *bts, off_t off, size_t len);
+int bts_prefetch(struct bt_stream *bts, off_t off, size_t len);
+void bts_sequential(struct bt_stream *bts);
 int bts_sha(struct bt_stream *bts, off_t start, off_t length, uint8_t *hash);
+int bts_sha_mb(struct bt_stream *bts, off_t start, off_t plen, unsigned n,
+    uint8_t *hashes);
 
 const char *bts_filename(struct bt_stream *bts);
 